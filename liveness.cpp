@@ -0,0 +1,206 @@
+/***********************************************************************
+ liveness.cpp - Schedules re-probes by staleness and volatility, and
+    turns probe results into confirmed up/down change events.
+***********************************************************************/
+
+#include <liveness.h>
+#include <algorithm>
+
+// Confidence steps needed to double the re-probe interval
+#define CONFIDENCE_PER_DOUBLING     8
+#define MAX_INTERVAL_DOUBLINGS      4
+
+/////////////////////////////// due_later //////////////////////////////
+// Heap ordering, true if a is due after b.  Compared as a signed
+// difference so the queue survives GetTickCount() wrapping.
+
+static bool due_later(const livedue& a, const livedue& b)
+{
+    return LONG(a.due - b.due) > 0;
+}
+
+////////////////////////////// schedule ////////////////////////////////
+
+static void schedule(livetracker& lt, size_t index, DWORD due)
+{
+    lt.hosts[index].next_due = due;
+
+    livedue d = { due, ULONG(index) };
+    lt.queue.push_back(d);
+    std::push_heap(lt.queue.begin(), lt.queue.end(), due_later);
+}
+
+////////////////////////////// interval ////////////////////////////////
+// Re-probe interval for a host that is not confirming a change: longer
+// the more results in a row have agreed, shorter the more it flapped.
+
+static DWORD interval(const livetracker& lt, const livehost& h)
+{
+    DWORD iv = lt.interval_ms;
+
+    int doublings = h.confidence / CONFIDENCE_PER_DOUBLING;
+    iv <<= min(doublings, MAX_INTERVAL_DOUBLINGS);
+    iv >>= min(int(h.flaps), MAX_INTERVAL_DOUBLINGS);
+
+    if (iv < lt.min_interval_ms)
+        iv = lt.min_interval_ms;
+    if (iv > lt.max_interval_ms)
+        iv = lt.max_interval_ms;
+
+    // Fixed per host offset of up to 1/8th so hosts added together
+    // don't stay in lock step
+    return iv + ULONG(h.ip * 2654435761UL) % (iv / 8 + 1);
+}
+
+////////////////////////////// transition //////////////////////////////
+
+static void transition(livetracker& lt, livehost& h, BYTE state, DWORD now)
+{
+    livechange c;
+    c.ip = h.ip;
+    c.old_state = h.state;
+    c.new_state = state;
+    c.at = now;
+    c.last_seen = h.last_seen;
+
+    // Discovering a host's first state isn't a flap
+    if (h.state != LIVE_UNKNOWN && h.flaps < MAX_LIVE_FLAPS)
+        ++h.flaps;
+
+    h.state = state;
+    h.confidence = 0;
+    h.pending = 0;
+
+    for (size_t i = 0; i < lt.subs.size(); ++i)
+        lt.subs[i].cb(c, lt.subs[i].ctx);
+}
+
+///////////////////////////// live_add_host ////////////////////////////
+
+size_t live_add_host(livetracker& lt, ULONG ip, DWORD now)
+{
+    livehost h;
+    memset(&h, 0, sizeof(h));
+    h.ip = ip;
+    h.state = LIVE_UNKNOWN;
+
+    lt.hosts.push_back(h);
+    schedule(lt, lt.hosts.size() - 1, now);
+
+    return lt.hosts.size() - 1;
+}
+
+///////////////////////////// live_subscribe ///////////////////////////
+
+void live_subscribe(livetracker& lt, livechange_cb cb, void * ctx)
+{
+    livesub s = { cb, ctx };
+    lt.subs.push_back(s);
+}
+
+///////////////////////////// live_next_due ////////////////////////////
+
+bool live_next_due(livetracker& lt, DWORD now, size_t& index)
+{
+    if (lt.queue.empty() || LONG(lt.queue.front().due - now) > 0)
+        return false;
+
+    index = lt.queue.front().index;
+    std::pop_heap(lt.queue.begin(), lt.queue.end(), due_later);
+    lt.queue.pop_back();
+
+    return true;
+}
+
+////////////////////////////// live_report /////////////////////////////
+
+void live_report(livetracker& lt, size_t index, bool up, DWORD now)
+{
+    livehost& h = lt.hosts[index];
+    BYTE seen = up ? LIVE_UP : LIVE_DOWN;
+
+    if (up)
+        h.last_seen = now;
+
+    if (h.state == LIVE_UNKNOWN) {
+        transition(lt, h, seen, now);
+    }
+    else if (seen == h.state) {
+        // Agrees, so any confirmation in progress was a blip
+        h.pending = 0;
+        if (h.confidence < MAX_LIVE_CONFIDENCE)
+            ++h.confidence;
+        if (h.flaps && h.confidence % CONFIDENCE_PER_DOUBLING == 0)
+            --h.flaps;
+    }
+    else {
+        // Disagrees, start or continue a confirmation burst
+        if (h.pending == 0)
+            h.pending = max(lt.confirm_count, BYTE(1));
+
+        if (--h.pending == 0) {
+            transition(lt, h, seen, now);
+        }
+        else {
+            schedule(lt, index, now + lt.confirm_ms);
+            return;
+        }
+    }
+
+    schedule(lt, index, now + interval(lt, h));
+}
+
+///////////////////////////// live_wait_ms /////////////////////////////
+
+DWORD live_wait_ms(const livetracker& lt, DWORD now)
+{
+    if (lt.queue.empty())
+        return INFINITE;
+
+    LONG wait = LONG(lt.queue.front().due - now);
+    return wait > 0 ? DWORD(wait) : 0;
+}
+
+/////////////////////////////// live_poll //////////////////////////////
+// Only answers from the network say anything about a host.  A failure
+// on our side, such as a raw socket refused without admin rights,
+// would otherwise mark every host down, so it stops the poll instead.
+
+int live_poll(livetracker& lt, winping& wp, DWORD now, int budget,
+              int& sent, int timeout)
+{
+    size_t index;
+    sent = 0;
+
+    while (sent < budget && live_next_due(lt, now, index)) {
+        sockaddr_in dest;
+        memset(&dest, 0, sizeof(dest));
+        dest.sin_family = AF_INET;
+        dest.sin_addr.s_addr = lt.hosts[index].ip;
+
+        pingstat ps;
+        int rc = wp.ping(dest, &ps, DEFAULT_PACKET_SIZE, DEFAULT_TTL, 1, timeout);
+
+        // The attempt's status says what came back.  An unreachable or
+        // TTL expired message only gets this far when it quotes this
+        // very probe, or when the send itself found no route; anyone
+        // else's ICMP errors are skipped while waiting, so at worst the
+        // attempt ends as a timeout.
+        int status = ps.pings.empty() ? rc : ps.pings[0]->status;
+        bool up = status == WSASUCCESS && !ps.pings.empty();
+        bool down = status == WSAETIMEDOUT ||
+                    status == WSAEHOSTUNREACH || status == WSAENETUNREACH ||
+                    (status & 0xefff0000) == ETTL_EXPIRED;
+
+        if (!up && !down) {
+            // Put the host back as it was, it is still due
+            schedule(lt, index, lt.hosts[index].next_due);
+            return status;
+        }
+
+        live_report(lt, index, up, GetTickCount());
+        ++sent;
+    }
+
+    return WSASUCCESS;
+}
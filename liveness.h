@@ -0,0 +1,111 @@
+/***********************************************************************
+ liveness.h - Declares the liveness tracker, which keeps an up/down
+    view of many hosts and only re-probes the ones that are due, so
+    probe volume follows churn rather than fleet size.
+***********************************************************************/
+
+#ifndef _LIVENESS_H_
+#define _LIVENESS_H_
+
+#include <winping.h>
+#include <vector>
+
+#define LIVE_UNKNOWN            0
+#define LIVE_UP                 1
+#define LIVE_DOWN               2
+
+#define DEFAULT_LIVE_INTERVAL_MS    30000
+#define DEFAULT_LIVE_MIN_MS         5000
+#define DEFAULT_LIVE_MAX_MS         600000
+#define DEFAULT_CONFIRM_MS          500
+#define DEFAULT_CONFIRM_COUNT       3
+#define MAX_LIVE_CONFIDENCE         64
+#define MAX_LIVE_FLAPS              8
+
+// Per host state, 16 bytes
+typedef struct _live_host_ {
+    ULONG   ip;             // Network byte order
+    DWORD   last_seen;      // GetTickCount() of the last reply
+    DWORD   next_due;       // GetTickCount() the next probe is due
+    BYTE    state;          // LIVE_UNKNOWN, LIVE_UP or LIVE_DOWN
+    BYTE    confidence;     // Results in a row agreeing with state
+    BYTE    pending;        // Disagreeing results still needed to flip state
+    BYTE    flaps;          // Recent transitions, decays while stable
+} livehost;
+
+// Passed to subscribers whenever a host changes state
+typedef struct _live_change_ {
+    ULONG   ip;
+    BYTE    old_state;
+    BYTE    new_state;
+    DWORD   at;             // GetTickCount() the change was confirmed
+    DWORD   last_seen;
+} livechange;
+
+typedef void (*livechange_cb)(const livechange&, void * ctx);
+
+typedef struct _live_due_ {
+    DWORD   due;
+    ULONG   index;          // Into livetracker::hosts
+} livedue;
+
+typedef struct _live_sub_ {
+    livechange_cb   cb;
+    void *          ctx;
+} livesub;
+
+typedef struct _live_tracker_ {
+    std::vector<livehost>   hosts;
+    std::vector<livedue>    queue;      // Min-heap on due, one entry per host
+    std::vector<livesub>    subs;
+    DWORD   interval_ms;                // Base re-probe interval
+    DWORD   min_interval_ms;
+    DWORD   max_interval_ms;
+    DWORD   confirm_ms;                 // Spacing of confirmation probes
+    BYTE    confirm_count;              // Disagreeing results needed to flip
+
+    _live_tracker_() : interval_ms(DEFAULT_LIVE_INTERVAL_MS),
+                       min_interval_ms(DEFAULT_LIVE_MIN_MS),
+                       max_interval_ms(DEFAULT_LIVE_MAX_MS),
+                       confirm_ms(DEFAULT_CONFIRM_MS),
+                       confirm_count(DEFAULT_CONFIRM_COUNT) {}
+} livetracker;
+
+/** Starts tracking ip (network byte order), first probe due at now.
+ *  Returns the host's index in tracker.hosts.
+ */
+extern size_t live_add_host(livetracker& lt, ULONG ip, DWORD now);
+
+/** Registers a callback invoked for every confirmed state change */
+extern void live_subscribe(livetracker& lt, livechange_cb cb, void * ctx);
+
+/** Pops the most overdue host if one is due at now. The host stays out
+ *  of the queue until live_report() is called for it.
+ *  Returns false if nothing is due yet.
+ */
+extern bool live_next_due(livetracker& lt, DWORD now, size_t& index);
+
+/** Feeds the result of a probe back for the host at index, notifies
+ *  subscribers if it confirms a change, and schedules the next probe.
+ *  A result disagreeing with the host's state starts a burst of
+ *  confirm_count probes confirm_ms apart, and subscribers only hear of
+ *  the change once they all agree. Hosts that keep answering the same
+ *  way are probed less and less often, hosts that flap more often.
+ */
+extern void live_report(livetracker& lt, size_t index, bool up, DWORD now);
+
+/** Milliseconds until the next host is due, 0 if one is due already
+ *  and INFINITE if nothing is tracked.
+ */
+extern DWORD live_wait_ms(const livetracker& lt, DWORD now);
+
+/** Probes up to budget due hosts through wp, one attempt each, and
+ *  stores the number of results reported in sent. Only timeouts and
+ *  unreachable answers count against a host; any other error is a
+ *  local failure, so the host is left due and the poll stops there.
+ *  Returns : WSASUCCESS, or the error winping::ping() returned.
+ */
+extern int  live_poll(livetracker& lt, winping& wp, DWORD now, int budget,
+                      int& sent, int timeout = DEFUALT_TIMEOUT_MS);
+
+#endif /* _LIVENESS_H_ */
@@ -0,0 +1,417 @@
+/***********************************************************************
+ pcapture.cpp - Buffered pcap capture of probe traffic, and a replay
+    that drives decode_reply() from a capture for benchmarking and
+    regression checks.
+***********************************************************************/
+
+#include <pcapture.h>
+#include <ip_checksum.h>
+#include <process.h>
+#include <vector>
+
+// 100ns ticks between 1601-01-01 (FILETIME) and 1970-01-01 (pcap)
+#define FILETIME_UNIX_EPOCH     116444736000000000ULL
+
+////////////////////////////// capture_ns //////////////////////////////
+// Wall clock in ns since 1970.  Anchored once to the system time and
+// advanced with the performance counter, which has far finer steps.
+
+static ULONGLONG capture_ns(const pcapture& pc)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+
+    ULONGLONG ticks = ULONGLONG(now.QuadPart) - pc.epoch_qpc;
+    ULONGLONG secs = ticks / pc.qpc_freq;
+    ULONGLONG rem  = ticks % pc.qpc_freq;
+
+    return pc.epoch_ns + secs * 1000000000ULL +
+           (rem * 1000000000ULL) / pc.qpc_freq;
+}
+
+//////////////////////////// open_ring_file ////////////////////////////
+// Opens path.N for the current ring slot and writes the file header.
+
+static int open_ring_file(pcapture& pc)
+{
+    if (pc.file)
+        fclose(pc.file);
+
+    char name[MAX_PCAP_PATH + 16];
+    sprintf_s(name, sizeof(name), "%s.%d", pc.path, pc.current_file);
+
+    if (fopen_s(&pc.file, name, "wb") != 0 || !pc.file) {
+        pc.file = NULL;
+        return EPCAP_OPEN_FAILED;
+    }
+
+    PcapFileHeader hdr;
+    hdr.magic = PCAP_MAGIC_NSEC;
+    hdr.version_major = PCAP_VERSION_MAJOR;
+    hdr.version_minor = PCAP_VERSION_MINOR;
+    hdr.thiszone = 0;
+    hdr.sigfigs = 0;
+    hdr.snaplen = 65535;
+    hdr.linktype = LINKTYPE_RAW;
+
+    if (fwrite(&hdr, sizeof(hdr), 1, pc.file) != 1)
+        return EPCAP_OPEN_FAILED;
+
+    pc.file_bytes = sizeof(hdr);
+    return WSASUCCESS;
+}
+
+///////////////////////////// writer_thread ////////////////////////////
+// Writes each buffer handed over by swap_buffers(), moving on to the
+// next ring file first if the batch would overflow the current one.
+
+static unsigned __stdcall writer_thread(void * arg)
+{
+    pcapture& pc = *(pcapture*)arg;
+
+    for (;;) {
+        WaitForSingleObject(pc.work_event, INFINITE);
+
+        if (pc.write_len) {
+            const char * batch = pc.buffers[pc.active ^ 1];
+
+            if (pc.file && pc.file_bytes > sizeof(PcapFileHeader) &&
+                    pc.file_bytes + pc.write_len > pc.max_file_bytes) {
+                pc.current_file = (pc.current_file + 1) % pc.ring_files;
+                if (open_ring_file(pc) != WSASUCCESS)
+                    pc.write_error = EPCAP_OPEN_FAILED;
+            }
+
+            if (pc.file) {
+                if (fwrite(batch, 1, pc.write_len, pc.file) != pc.write_len)
+                    pc.write_error = EPCAP_OPEN_FAILED;
+                pc.file_bytes += pc.write_len;
+            }
+
+            pc.write_len = 0;
+        }
+
+        bool stopping = pc.stop;
+        SetEvent(pc.idle_event);
+        if (stopping)
+            break;
+    }
+
+    return 0;
+}
+
+///////////////////////////// swap_buffers /////////////////////////////
+// Hands the active buffer to the writer and carries on in the other.
+// Only blocks if the writer hasn't finished the previous one yet.
+
+static void swap_buffers(pcapture& pc)
+{
+    WaitForSingleObject(pc.idle_event, INFINITE);
+    ResetEvent(pc.idle_event);
+
+    pc.write_len = pc.fill;
+    pc.active ^= 1;
+    pc.fill = 0;
+
+    SetEvent(pc.work_event);
+}
+
+///////////////////////////// append_record ////////////////////////////
+// Copies one record, optionally in two pieces, into the active buffer.
+// A capture that failed to open, or is closed, has no writer and takes
+// nothing.
+
+static void append_record(pcapture& pc, const void * head, size_t head_len,
+                          const void * body, size_t body_len)
+{
+    if (!pc.thread)
+        return;
+
+    size_t len = head_len + body_len;
+    size_t need = sizeof(PcapRecordHeader) + len;
+
+    if (need > pc.buf_size) {
+        ++pc.dropped;
+        return;
+    }
+    if (pc.fill + need > pc.buf_size)
+        swap_buffers(pc);
+
+    ULONGLONG ns = capture_ns(pc);
+
+    PcapRecordHeader rec;
+    rec.ts_sec = ULONG(ns / 1000000000ULL);
+    rec.ts_frac = ULONG(ns % 1000000000ULL);
+    rec.incl_len = ULONG(len);
+    rec.orig_len = ULONG(len);
+
+    char * out = pc.buffers[pc.active] + pc.fill;
+    memcpy(out, &rec, sizeof(rec));
+    out += sizeof(rec);
+    if (head_len)
+        memcpy(out, head, head_len);
+    memcpy(out + head_len, body, body_len);
+
+    pc.fill += need;
+}
+
+//////////////////////////// release_capture ///////////////////////////
+// Frees whatever pcap_open() got as far as creating.  The writer thread
+// must already have exited, or never have started.
+
+static void release_capture(pcapture& pc)
+{
+    if (pc.thread)
+        CloseHandle(pc.thread);
+    if (pc.work_event)
+        CloseHandle(pc.work_event);
+    if (pc.idle_event)
+        CloseHandle(pc.idle_event);
+    pc.thread = pc.work_event = pc.idle_event = NULL;
+
+    if (pc.file)
+        fclose(pc.file);
+    pc.file = NULL;
+
+    delete[] pc.buffers[0];
+    delete[] pc.buffers[1];
+    pc.buffers[0] = pc.buffers[1] = NULL;
+}
+
+/////////////////////////////// pcap_open //////////////////////////////
+
+int pcap_open(pcapture& pc, const char* path, int ring_files,
+              ULONGLONG max_file_bytes, size_t buffer_size)
+{
+    memset(&pc, 0, sizeof(pc));
+
+    if (!path || strlen(path) >= MAX_PCAP_PATH)
+        return EPCAP_OPEN_FAILED;
+    strcpy_s(pc.path, MAX_PCAP_PATH, path);
+
+    pc.ring_files = ring_files > 0 ? ring_files : DEFAULT_PCAP_RING;
+    pc.max_file_bytes = max_file_bytes ? max_file_bytes : DEFAULT_PCAP_FILE_SIZE;
+    pc.buf_size = buffer_size ? buffer_size : DEFAULT_PCAP_BUFFER;
+
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    LARGE_INTEGER qpc, freq;
+    QueryPerformanceCounter(&qpc);
+    QueryPerformanceFrequency(&freq);
+
+    ULONGLONG ticks = (ULONGLONG(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+    pc.epoch_ns = (ticks - FILETIME_UNIX_EPOCH) * 100;
+    pc.epoch_qpc = qpc.QuadPart;
+    pc.qpc_freq = freq.QuadPart;
+
+    pc.buffers[0] = new char[pc.buf_size];
+    pc.buffers[1] = new char[pc.buf_size];
+    if (!pc.buffers[0] || !pc.buffers[1]) {
+        release_capture(pc);
+        return EBUFFER_ALLOCATION_FAILED;
+    }
+
+    int rc = open_ring_file(pc);
+    if (rc != WSASUCCESS) {
+        release_capture(pc);
+        return rc;
+    }
+
+    // Without the writer every swap_buffers() after the first would
+    // wait on idle_event forever, so nothing is left half open
+    pc.work_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    pc.idle_event = CreateEvent(NULL, TRUE, TRUE, NULL);
+    if (!pc.work_event || !pc.idle_event) {
+        release_capture(pc);
+        return EPCAP_OPEN_FAILED;
+    }
+
+    pc.thread = (HANDLE)_beginthreadex(NULL, 0, writer_thread, &pc, 0, NULL);
+    if (!pc.thread) {
+        release_capture(pc);
+        return EPCAP_OPEN_FAILED;
+    }
+
+    return WSASUCCESS;
+}
+
+///////////////////////////// pcap_received ////////////////////////////
+
+void pcap_received(pcapture& pc, const IPHeader* packet, int bytes)
+{
+    if (bytes > 0)
+        append_record(pc, NULL, 0, packet, bytes);
+}
+
+/////////////////////////////// pcap_sent //////////////////////////////
+// Raw ICMP sockets hand the kernel only the ICMP message, so build the
+// IPv4 header it would have been given for the capture.  The source is
+// left as 0.0.0.0 since the route decides it.
+
+void pcap_sent(pcapture& pc, const sockaddr_in& dest, const ICMPHeader* packet,
+               int bytes, int ttl)
+{
+    if (bytes <= 0)
+        return;
+
+    IPHeader ip;
+    memset(&ip, 0, sizeof(ip));
+    ip.version = 4;
+    ip.h_len = sizeof(IPHeader) / 4;
+    ip.total_len = htons(USHORT(sizeof(IPHeader) + bytes));
+    ip.ttl = BYTE(ttl);
+    ip.proto = IPPROTO_ICMP;
+    ip.dest_ip = dest.sin_addr.s_addr;
+    ip.checksum = ip_checksum((USHORT*)&ip, sizeof(ip));
+
+    append_record(pc, &ip, sizeof(ip), packet, bytes);
+}
+
+////////////////////////////// pcap_flush //////////////////////////////
+
+int pcap_flush(pcapture& pc)
+{
+    if (!pc.thread)
+        return EPCAP_OPEN_FAILED;
+
+    if (pc.fill)
+        swap_buffers(pc);
+
+    WaitForSingleObject(pc.idle_event, INFINITE);
+    if (pc.file)
+        fflush(pc.file);
+
+    return pc.write_error ? pc.write_error : WSASUCCESS;
+}
+
+////////////////////////////// pcap_close //////////////////////////////
+
+void pcap_close(pcapture& pc)
+{
+    if (!pc.thread)
+        return;
+
+    pcap_flush(pc);
+
+    // Wake the writer one last time with nothing to do but exit
+    WaitForSingleObject(pc.idle_event, INFINITE);
+    ResetEvent(pc.idle_event);
+    pc.stop = true;
+    SetEvent(pc.work_event);
+    WaitForSingleObject(pc.thread, INFINITE);
+
+    release_capture(pc);
+}
+
+////////////////////////////// pcap_replay /////////////////////////////
+// Loads the whole capture first so only decoding is timed.
+
+int pcap_replay(const char* path, pcapreplay& stats, int passes, USHORT id)
+{
+    memset(&stats, 0, sizeof(stats));
+
+    FILE * f;
+    if (fopen_s(&f, path, "rb") != 0 || !f)
+        return EPCAP_OPEN_FAILED;
+
+    PcapFileHeader hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+            (hdr.magic != PCAP_MAGIC_NSEC && hdr.magic != PCAP_MAGIC_USEC) ||
+            (hdr.linktype != LINKTYPE_RAW && hdr.linktype != LINKTYPE_IPV4)) {
+        fclose(f);
+        return EPCAP_FORMAT;
+    }
+
+    std::vector<char> data;
+    std::vector<size_t> offsets;
+    std::vector<ULONG> lengths;
+
+    PcapRecordHeader rec;
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        if (rec.incl_len > hdr.snaplen || rec.incl_len > 0xffff) {
+            fclose(f);
+            return EPCAP_FORMAT;
+        }
+
+        size_t at = data.size();
+        data.resize(at + rec.incl_len);
+        if (rec.incl_len && fread(&data[at], 1, rec.incl_len, f) != rec.incl_len) {
+            fclose(f);
+            return EPCAP_FORMAT;
+        }
+
+        offsets.push_back(at);
+        lengths.push_back(rec.incl_len);
+    }
+    fclose(f);
+
+    // Sent requests are only counted, and the first one tells us the
+    // id the capturing process stamped its probes with
+    std::vector<bool> request(offsets.size(), false);
+    bool have_id = id != 0;
+    for (size_t i = 0; i < offsets.size(); ++i) {
+        if (lengths[i] < sizeof(IPHeader))
+            continue;
+
+        const IPHeader * ip = (const IPHeader*)&data[offsets[i]];
+        size_t header_len = ip->h_len * 4;
+        if (lengths[i] < header_len + ICMP_MIN)
+            continue;
+
+        ICMPHeader icmp;
+        memcpy(&icmp, &data[offsets[i] + header_len], ICMP_MIN);
+        if (icmp.type != ICMP_ECHO_REQUEST)
+            continue;
+
+        request[i] = true;
+        if (!have_id) {
+            id = icmp.id;
+            have_id = true;
+        }
+    }
+    if (!have_id)
+        id = (USHORT)GetCurrentProcessId();
+    stats.id = id;
+
+    // Every record gets its own aligned scratch copy, decode_reply()
+    // reads the packet in place like it would from recv_buf
+    IPHeader * scratch = (IPHeader*)new char[0x10000];
+    if (!scratch)
+        return EBUFFER_ALLOCATION_FAILED;
+
+    pingreq pr;
+    ULONGLONG start = timestamp_us();
+
+    for (int pass = 0; pass < passes; ++pass) {
+        for (size_t i = 0; i < offsets.size(); ++i) {
+            // Too short for even an IP header, decode_reply would overread
+            if (lengths[i] < sizeof(IPHeader)) {
+                ++stats.errors;
+                continue;
+            }
+
+            ++stats.packets;
+            stats.bytes += lengths[i];
+
+            if (request[i]) {
+                ++stats.requests;
+                continue;
+            }
+
+            memcpy(scratch, &data[offsets[i]], lengths[i]);
+
+            int rc = decode_reply(scratch, lengths[i], NULL, &pr, id);
+            if (rc == WSASUCCESS)
+                ++stats.decoded;
+            else if (rc == WSATRY_AGAIN)
+                ++stats.ignored;
+            else
+                ++stats.errors;
+        }
+    }
+
+    stats.elapsed_us = timestamp_us() - start;
+    delete[] (char*)scratch;
+
+    return WSASUCCESS;
+}
@@ -0,0 +1,121 @@
+/***********************************************************************
+ pcapture.h - Declares the optional pcap capture of probe traffic and
+    the offline replay of a capture back through decode_reply().
+***********************************************************************/
+
+#ifndef _PCAPTURE_H_
+#define _PCAPTURE_H_
+
+#include <rawping.h>
+#include <cstdio>
+
+#define PCAP_MAGIC_NSEC         0xa1b23c4d
+#define PCAP_MAGIC_USEC         0xa1b2c3d4
+#define PCAP_VERSION_MAJOR      2
+#define PCAP_VERSION_MINOR      4
+#define LINKTYPE_RAW            101
+#define LINKTYPE_IPV4           228
+
+#define DEFAULT_PCAP_BUFFER     (256 * 1024)
+#define DEFAULT_PCAP_FILE_SIZE  (64 * 1024 * 1024)
+#define DEFAULT_PCAP_RING       4
+#define MAX_PCAP_PATH           260
+
+struct PcapFileHeader {
+    ULONG   magic;
+    USHORT  version_major;
+    USHORT  version_minor;
+    LONG    thiszone;
+    ULONG   sigfigs;
+    ULONG   snaplen;
+    ULONG   linktype;
+};
+
+struct PcapRecordHeader {
+    ULONG   ts_sec;
+    ULONG   ts_frac;            // Nanoseconds, or microseconds in usec files
+    ULONG   incl_len;
+    ULONG   orig_len;
+};
+
+typedef struct _pcap_capture_ {
+    char        path[MAX_PCAP_PATH];    // Base name of the ring files
+    FILE *      file;
+    int         ring_files;
+    int         current_file;
+    ULONGLONG   max_file_bytes;
+    ULONGLONG   file_bytes;             // Written to the current file
+    char *      buffers[2];
+    size_t      buf_size;
+    size_t      fill;                   // Bytes used in the active buffer
+    int         active;                 // Buffer the probe path copies into
+    size_t      write_len;              // Bytes handed to the writer
+    HANDLE      thread;
+    HANDLE      work_event;             // Set when a buffer is handed over
+    HANDLE      idle_event;             // Set while the writer has nothing
+    volatile bool stop;
+    int         write_error;            // Last error seen by the writer
+    ULONGLONG   epoch_ns;               // Wall clock at open, ns since 1970
+    ULONGLONG   epoch_qpc;              // Performance counter at open
+    ULONGLONG   qpc_freq;
+    ULONGLONG   dropped;                // Records too large for a buffer
+} pcapture;
+
+// Outcome counts and throughput of a replay
+typedef struct _pcap_replay_ {
+    ULONGLONG   packets;
+    ULONGLONG   bytes;
+    ULONGLONG   requests;               // Sent echo requests, not decoded
+    ULONGLONG   decoded;                // decode_reply() == WSASUCCESS
+    ULONGLONG   ignored;                // WSATRY_AGAIN, e.g. another pinger's id
+    ULONGLONG   errors;                 // Any other return code
+    USHORT      id;                     // Echo id replies were matched against
+    ULONGLONG   elapsed_us;             // Decode time only, file I/O excluded
+} pcapreplay;
+
+/** Opens path.0 and starts the writer thread. A buffer_size or
+ *  max_file_bytes of 0 picks the defaults above. On failure nothing is
+ *  left open, and records passed to the capture are ignored.
+ *  Files are nanosecond pcap with LINKTYPE_RAW, so every record starts
+ *  at the IPv4 header, and output rotates through path.0 .. path.N-1
+ *  once a file reaches max_file_bytes. Records are copied into one of
+ *  two buffers while the writer thread flushes the other, keeping file
+ *  I/O off the probe path.
+ *  Returns : WSASUCCESS, EPCAP_OPEN_FAILED or EBUFFER_ALLOCATION_FAILED.
+ */
+extern int  pcap_open(pcapture& pc, const char* path,
+                      int ring_files = DEFAULT_PCAP_RING,
+                      ULONGLONG max_file_bytes = DEFAULT_PCAP_FILE_SIZE,
+                      size_t buffer_size = DEFAULT_PCAP_BUFFER);
+
+/** Records a received packet, starting at its IP header.
+ *  NB: Not safe to call from more than one thread at a time.
+ */
+extern void pcap_received(pcapture& pc, const IPHeader* packet, int bytes);
+
+/** Records a sent echo request, prefixed with a synthesized IPv4 header
+ *  addressed to dest.
+ */
+extern void pcap_sent(pcapture& pc, const sockaddr_in& dest, const ICMPHeader* packet,
+                      int bytes, int ttl);
+
+/** Hands any buffered records to the writer and waits until they are
+ *  on disk. Returns the writer's last error, WSASUCCESS if none.
+ */
+extern int  pcap_flush(pcapture& pc);
+
+/** Flushes, stops the writer thread and closes the current file */
+extern void pcap_close(pcapture& pc);
+
+/** Decodes every reply in a capture through decode_reply() passes
+ *  times, as fast as possible, and reports outcome counts and timing.
+ *  Replies are matched against id, or with an id of 0 against the id
+ *  of the first echo request in the capture, so captures taken by an
+ *  earlier process still decode.  Requests are counted, not decoded.
+ *  Returns : WSASUCCESS, EPCAP_OPEN_FAILED, EPCAP_FORMAT or
+ *            EBUFFER_ALLOCATION_FAILED.
+ */
+extern int  pcap_replay(const char* path, pcapreplay& stats, int passes = 1,
+                        USHORT id = 0);
+
+#endif /* _PCAPTURE_H_ */
@@ -0,0 +1,205 @@
+/***********************************************************************
+ pingbench.cpp - Micro benchmarks for the hot paths of the library,
+    so the figures quoted for them can be reproduced on any machine.
+
+ Usage  : pingbench payload [-n bytes] [-r rounds]
+            Times payload_mismatch() against payload_mismatch_scalar()
+            on n byte buffers (default 1024) with a few bytes damaged,
+            and checks both count the same mismatches.
+          pingbench history [-n targets] [-r seconds]
+            Registers n targets (default 100000) in an rtthistory,
+            records one probe per target per second for r seconds
+            (default 60) and then queries every target's last hour.
+          pingbench replay file [-r passes]
+            Decodes every reply in a capture written by pcap_open()
+            passes times (default 1) and reports the decode rate and
+            outcome counts, as a benchmark or a regression corpus.
+***********************************************************************/
+
+#include <rawping.h>
+#include <rtthist.h>
+#include <pcapture.h>
+#include <cstdio>
+
+#define DEFAULT_BENCH_BYTES     1024
+#define DEFAULT_BENCH_ROUNDS    1000000
+#define BENCH_DAMAGED_EVERY     97
+#define DEFAULT_BENCH_TARGETS   100000
+#define DEFAULT_BENCH_SECONDS   60
+#define BENCH_EPOCH             1700000000  // Any fixed time will do
+#define BENCH_LOST_EVERY        10
+
+// Stops the compiler from dropping results nobody looks at
+static volatile size_t bench_sink;
+
+///////////////////////////////// usage ////////////////////////////////
+
+static int usage(void)
+{
+    fprintf(stderr,
+            "usage: pingbench payload [-n bytes] [-r rounds]\n"
+            "       pingbench history [-n targets] [-r seconds]\n"
+            "       pingbench replay file [-r passes]\n");
+    return 2;
+}
+
+///////////////////////////// bench_payload ////////////////////////////
+// Runs each compare over the same pair of buffers rounds times.  The
+// buffers are offset by one byte from the allocation so the unaligned
+// loads are exercised the way they are on a received packet.
+
+static int bench_payload(size_t bytes, ULONG rounds)
+{
+    char * a = new char[bytes + 1];
+    char * b = new char[bytes + 1];
+    BYTE * pa = (BYTE*)a + 1;
+    BYTE * pb = (BYTE*)b + 1;
+
+    for (size_t i = 0; i < bytes; ++i)
+        pa[i] = pb[i] = BYTE('A' + i % 26);
+    for (size_t i = 0; i < bytes; i += BENCH_DAMAGED_EVERY)
+        pb[i] ^= 0x5a;
+
+    size_t fast = payload_mismatch(pa, pb, bytes);
+    size_t slow = payload_mismatch_scalar(pa, pb, bytes);
+
+    ULONGLONG start = timestamp_us();
+    for (ULONG r = 0; r < rounds; ++r)
+        bench_sink = payload_mismatch(pa, pb, bytes);
+    ULONGLONG fast_us = timestamp_us() - start;
+
+    start = timestamp_us();
+    for (ULONG r = 0; r < rounds; ++r)
+        bench_sink = payload_mismatch_scalar(pa, pb, bytes);
+    ULONGLONG slow_us = timestamp_us() - start;
+
+    printf("payload %u bytes, %lu rounds, %u mismatched\n",
+           (unsigned)bytes, (unsigned long)rounds, (unsigned)slow);
+    printf("  payload_mismatch         %8.1f ns\n", fast_us * 1000.0 / rounds);
+    printf("  payload_mismatch_scalar  %8.1f ns\n", slow_us * 1000.0 / rounds);
+
+    delete[] a;
+    delete[] b;
+
+    if (fast != slow) {
+        fprintf(stderr, "pingbench: compare disagrees, %u vs %u\n",
+                (unsigned)fast, (unsigned)slow);
+        return 1;
+    }
+    return 0;
+}
+
+///////////////////////////// bench_history ////////////////////////////
+// Samples are recorded second by second across all targets, the way a
+// sweep would, so inserts walk the bucket array rather than staying in
+// one target's cache lines.
+
+static int bench_history(size_t targets, ULONG seconds)
+{
+    rtthistory h;
+    for (size_t i = 0; i < targets; ++i)
+        hist_target(h, htonl(ULONG(0x0a000000 + i)), true);
+
+    ULONGLONG start = timestamp_us();
+    for (ULONG s = 0; s < seconds; ++s)
+        for (size_t i = 0; i < targets; ++i)
+            hist_record(h, i, BENCH_EPOCH + s, i % BENCH_LOST_EVERY == 0,
+                        ULONG(1000 + (i * 7 + s) % 5000));
+    ULONGLONG insert_us = timestamp_us() - start;
+
+    histsummary out;
+    ULONGLONG answered = 0;
+    ULONG now = BENCH_EPOCH + seconds;
+
+    start = timestamp_us();
+    for (size_t i = 0; i < targets; ++i) {
+        hist_query(h, i, HIST_LEVEL_MINUTES, now - 3600, now, out);
+        answered += out.count - out.lost;
+    }
+    ULONGLONG query_us = timestamp_us() - start;
+    bench_sink = size_t(answered);
+
+    ULONGLONG inserts = ULONGLONG(targets) * seconds;
+    printf("history %u targets, %lu seconds, %u MB of buckets\n",
+           (unsigned)targets, (unsigned long)seconds,
+           (unsigned)((h.buckets.size() * sizeof(HistBucket)) >> 20));
+    printf("  hist_record  %8.1f ns\n", inserts ? insert_us * 1000.0 / inserts : 0.0);
+    printf("  hist_query   %8.1f ns\n", targets ? query_us * 1000.0 / targets : 0.0);
+
+    // Runs of up to 50 minutes still fit the hour queried, check them
+    ULONGLONG expected = inserts - (targets + BENCH_LOST_EVERY - 1) / BENCH_LOST_EVERY * seconds;
+    if (seconds <= 3000 && answered != expected) {
+        fprintf(stderr, "pingbench: history lost samples\n");
+        return 1;
+    }
+    return 0;
+}
+
+///////////////////////////// bench_replay /////////////////////////////
+
+static int bench_replay(const char * path, int passes)
+{
+    pcapreplay stats;
+    int rc = pcap_replay(path, stats, passes);
+    if (rc != WSASUCCESS) {
+        fprintf(stderr, "pingbench: cannot replay %s [0x%.8x]\n", path, rc);
+        return 1;
+    }
+
+    ULONGLONG replies = stats.packets - stats.requests;
+    printf("replay %s, %d passes, echo id %u\n", path, passes, (unsigned)stats.id);
+    printf("  packets %llu (%llu bytes), requests %llu\n",
+           stats.packets, stats.bytes, stats.requests);
+    printf("  decoded %llu, ignored %llu, errors %llu\n",
+           stats.decoded, stats.ignored, stats.errors);
+    printf("  decode_reply %8.1f ns, %.0f replies/s\n",
+           replies ? stats.elapsed_us * 1000.0 / replies : 0.0,
+           stats.elapsed_us ? replies * 1e6 / stats.elapsed_us : 0.0);
+
+    return 0;
+}
+
+///////////////////////////////// main /////////////////////////////////
+
+int main(int argc, char * argv[])
+{
+    if (argc < 2)
+        return usage();
+
+    const char * mode = argv[1];
+    const char * file = NULL;
+    size_t count = 0;
+    ULONG rounds = 0;
+
+    // Replay names its capture before any options
+    int first = 2;
+    if (strcmp(mode, "replay") == 0) {
+        if (argc < 3)
+            return usage();
+        file = argv[first++];
+    }
+
+    for (int i = first; i < argc; i += 2) {
+        if (argv[i][0] != '-' || i + 1 >= argc)
+            return usage();
+
+        const char * val = argv[i + 1];
+        switch (argv[i][1]) {
+            case 'n': count = strtoul(val, NULL, 10); break;
+            case 'r': rounds = strtoul(val, NULL, 10); break;
+            default:
+                return usage();
+        }
+    }
+
+    if (strcmp(mode, "payload") == 0)
+        return bench_payload(count ? count : DEFAULT_BENCH_BYTES,
+                             rounds ? rounds : DEFAULT_BENCH_ROUNDS);
+    if (strcmp(mode, "history") == 0)
+        return bench_history(count ? count : DEFAULT_BENCH_TARGETS,
+                             rounds ? rounds : DEFAULT_BENCH_SECONDS);
+    if (file)
+        return bench_replay(file, rounds ? int(rounds) : 1);
+
+    return usage();
+}
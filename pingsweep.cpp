@@ -0,0 +1,563 @@
+/***********************************************************************
+ pingsweep.cpp - fping style command line driver.  Streams targets
+    from the command line, files or stdin and keeps a fixed window of
+    stateless probes in flight, so memory stays constant however long
+    the target list is.
+
+ Usage  : pingsweep [options] [target ...]
+    -f file     Read targets from file, one per line (repeatable,
+                "-" for stdin).  stdin is read if no target is given.
+    -o format   text (default), csv or ndjson.
+    -s size     Packet size, default DEFAULT_PACKET_SIZE.
+    -l ttl      TTL, default DEFAULT_TTL.
+    -t ms       Per probe timeout, default 1000.
+    -r retries  Extra attempts for silent targets, default 1.
+    -w window   Probes in flight at once, default 1024, max 8192.
+    -p pps      Send rate limit in probes per second, 0 for none.
+    -q secs     Print a summary to stderr every secs seconds.
+    -a          Only print alive targets.
+
+ Targets are anything add_targets() accepts: addresses, hostnames,
+ CIDR blocks and ranges.  Blank lines and lines starting with '#'
+ are skipped.
+***********************************************************************/
+
+#include <rawping.h>
+#include <targets.h>
+#include <cstdio>
+
+#define MAX_TARGET_LINE     256
+#define OUTPUT_BUFFER_SIZE  (64 * 1024)
+#define OUTPUT_FLUSH_AT     (OUTPUT_BUFFER_SIZE - 256)
+#define DEFAULT_WINDOW      1024
+#define MAX_WINDOW_BITS     13
+#define DEFAULT_SWEEP_MS    1000
+#define DEFAULT_RETRIES     1
+#define SOCKET_BUFFER_SIZE  (4 * 1024 * 1024)
+#define MAX_WAIT_US         2000
+
+#define FORMAT_TEXT         0
+#define FORMAT_CSV          1
+#define FORMAT_NDJSON       2
+
+// One outstanding probe.  The low bits of a probe's seq are its slot,
+// the high bits a generation so replies to a reused slot's previous
+// occupant are told apart.
+typedef struct _probe_slot_ {
+    ULONG       ip;             // Network byte order
+    ULONGLONG   sent_us;
+    USHORT      seq;
+    BYTE        tries;
+    bool        busy;
+} probeslot;
+
+typedef struct _target_source_ {
+    char **     args;           // Targets given on the command line
+    int         nargs;
+    int         next_arg;
+    char **     files;          // Files to read, "-" for stdin
+    int         nfiles;
+    int         next_file;
+    FILE *      in;
+    targetgen   tg;             // Expansion of the current line
+    bool        in_gen;
+    char        line[MAX_TARGET_LINE];
+    ULONGLONG   bad_lines;
+} targetsource;
+
+typedef struct _sweep_counts_ {
+    ULONGLONG   targets;
+    ULONGLONG   sent;
+    ULONGLONG   alive;
+    ULONGLONG   unreachable;
+    ULONGLONG   rejected;       // Replies failing the stamp checks
+} sweepcounts;
+
+static char     out_buf[OUTPUT_BUFFER_SIZE];
+static size_t   out_len = 0;
+static int      out_format = FORMAT_TEXT;
+static bool     alive_only = false;
+
+
+///////////////////////////// output helpers ///////////////////////////
+// Results are formatted by hand into one static buffer and written
+// out in large blocks, so printing a result never allocates.
+
+static void out_flush(void)
+{
+    if (out_len) {
+        fwrite(out_buf, 1, out_len, stdout);
+        out_len = 0;
+    }
+}
+
+static void out_str(const char * s)
+{
+    while (*s)
+        out_buf[out_len++] = *s++;
+}
+
+static void out_uint(ULONGLONG v)
+{
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = char('0' + v % 10);
+        v /= 10;
+    } while (v);
+    while (n)
+        out_buf[out_len++] = digits[--n];
+}
+
+static void out_ip(ULONG ip)
+{
+    const BYTE * b = (const BYTE*)&ip;
+    for (int i = 0; i < 4; ++i) {
+        if (i)
+            out_buf[out_len++] = '.';
+        out_uint(b[i]);
+    }
+}
+
+// Milliseconds with three decimals, from microseconds
+static void out_ms(ULONGLONG us)
+{
+    out_uint(us / 1000);
+    out_buf[out_len++] = '.';
+    out_buf[out_len++] = char('0' + (us / 100) % 10);
+    out_buf[out_len++] = char('0' + (us / 10) % 10);
+    out_buf[out_len++] = char('0' + us % 10);
+}
+
+////////////////////////////// emit_result /////////////////////////////
+
+static void emit_result(ULONG ip, bool alive, ULONGLONG rtt_us, int ttl)
+{
+    if (!alive && alive_only)
+        return;
+
+    switch (out_format) {
+        case FORMAT_CSV:
+            out_ip(ip);
+            out_str(alive ? ",alive," : ",unreachable,,");
+            if (alive) {
+                out_uint(rtt_us);
+                out_buf[out_len++] = ',';
+                out_uint(ttl);
+            }
+            break;
+        case FORMAT_NDJSON:
+            out_str("{\"addr\":\"");
+            out_ip(ip);
+            out_str(alive ? "\",\"status\":\"alive\",\"rtt_us\":"
+                          : "\",\"status\":\"unreachable\"}");
+            if (alive) {
+                out_uint(rtt_us);
+                out_str(",\"ttl\":");
+                out_uint(ttl);
+                out_buf[out_len++] = '}';
+            }
+            break;
+        default:
+            out_ip(ip);
+            if (alive) {
+                out_str(" is alive (");
+                out_ms(rtt_us);
+                out_str(" ms)");
+            }
+            else
+                out_str(" is unreachable");
+            break;
+    }
+    out_buf[out_len++] = '\n';
+
+    if (out_len >= OUTPUT_FLUSH_AT)
+        out_flush();
+}
+
+/////////////////////////////// next_line //////////////////////////////
+// Returns the next non-blank target spec, from the command line first
+// and then from each file in turn, or NULL once everything is read.
+
+static const char * next_line(targetsource& src)
+{
+    if (src.next_arg < src.nargs)
+        return src.args[src.next_arg++];
+
+    for (;;) {
+        if (!src.in) {
+            if (src.next_file >= src.nfiles)
+                return NULL;
+
+            const char * name = src.files[src.next_file++];
+            if (strcmp(name, "-") == 0)
+                src.in = stdin;
+            else if (fopen_s(&src.in, name, "r") != 0 || !src.in) {
+                fprintf(stderr, "pingsweep: cannot open %s\n", name);
+                src.in = NULL;
+                continue;
+            }
+        }
+
+        if (!fgets(src.line, sizeof(src.line), src.in)) {
+            if (src.in != stdin)
+                fclose(src.in);
+            src.in = NULL;
+            continue;
+        }
+
+        char * p = src.line;
+        while (*p == ' ' || *p == '\t')
+            ++p;
+        size_t len = strlen(p);
+        while (len && (p[len-1] == '\n' || p[len-1] == '\r' ||
+                       p[len-1] == ' ' || p[len-1] == '\t'))
+            p[--len] = '\0';
+
+        if (len && *p != '#')
+            return p;
+    }
+}
+
+////////////////////////////// next_dest ///////////////////////////////
+// Produces the next address to probe.  Plain dotted quads skip the
+// generator entirely; anything else is expanded through it, reusing
+// the same targetgen so its vectors keep their capacity.
+
+static bool next_dest(targetsource& src, sockaddr_in& dest)
+{
+    for (;;) {
+        if (src.in_gen) {
+            if (next_target(src.tg, dest))
+                return true;
+            src.in_gen = false;
+        }
+
+        const char * spec = next_line(src);
+        if (!spec)
+            return false;
+
+        ULONG addr = inet_addr(spec);
+        if (addr != INADDR_NONE) {
+            memset(&dest, 0, sizeof(dest));
+            dest.sin_family = AF_INET;
+            dest.sin_addr.s_addr = addr;
+            return true;
+        }
+
+        src.tg.include.clear();
+        src.tg.exclude.clear();
+        if (add_targets(src.tg, spec) != WSASUCCESS ||
+                prepare_targets(src.tg) != WSASUCCESS) {
+            fprintf(stderr, "pingsweep: bad target %s\n", spec);
+            ++src.bad_lines;
+            continue;
+        }
+        src.in_gen = true;
+    }
+}
+
+///////////////////////////// print_summary ////////////////////////////
+
+static void print_summary(const sweepcounts& c, int inflight, ULONGLONG elapsed_us)
+{
+    double secs = elapsed_us / 1e6;
+    fprintf(stderr,
+            "[%.1fs] sent=%llu alive=%llu unreachable=%llu inflight=%d "
+            "rejected=%llu rate=%.0f/s\n",
+            secs, c.sent, c.alive, c.unreachable, inflight, c.rejected,
+            secs > 0 ? c.sent / secs : 0.0);
+}
+
+///////////////////////////////// usage ////////////////////////////////
+
+static int usage(void)
+{
+    fprintf(stderr,
+            "usage: pingsweep [-f file] [-o text|csv|ndjson] [-s size] [-l ttl]\n"
+            "                 [-t ms] [-r retries] [-w window] [-p pps] [-q secs]\n"
+            "                 [-a] [target ...]\n");
+    return 2;
+}
+
+///////////////////////////////// main /////////////////////////////////
+
+int main(int argc, char * argv[])
+{
+    int packet_size = DEFAULT_PACKET_SIZE;
+    int ttl = DEFAULT_TTL;
+    int timeout = DEFAULT_SWEEP_MS;
+    int retries = DEFAULT_RETRIES;
+    int window = DEFAULT_WINDOW;
+    ULONG pps = 0;
+    ULONG summary_secs = 0;
+
+    targetsource src;
+    src.next_arg = src.nargs = 0;
+    src.next_file = src.nfiles = 0;
+    src.in = NULL;
+    src.in_gen = false;
+    src.bad_lines = 0;
+
+    // Option values and file names are only pointed at, never copied
+    char ** files = new char*[argc];
+    src.files = files;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; ++i) {
+        char opt = argv[i][1];
+        if (opt == 'a') {
+            alive_only = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+            return usage();
+
+        const char * val = argv[++i];
+        switch (opt) {
+            case 'f': files[src.nfiles++] = argv[i]; break;
+            case 's': packet_size = atoi(val); break;
+            case 'l': ttl = atoi(val); break;
+            case 't': timeout = atoi(val); break;
+            case 'r': retries = atoi(val); break;
+            case 'w': window = atoi(val); break;
+            case 'p': pps = strtoul(val, NULL, 10); break;
+            case 'q': summary_secs = strtoul(val, NULL, 10); break;
+            case 'o':
+                if (strcmp(val, "csv") == 0)
+                    out_format = FORMAT_CSV;
+                else if (strcmp(val, "ndjson") == 0)
+                    out_format = FORMAT_NDJSON;
+                else if (strcmp(val, "text") == 0)
+                    out_format = FORMAT_TEXT;
+                else
+                    return usage();
+                break;
+            default:
+                return usage();
+        }
+    }
+
+    src.args = argv + i;
+    src.nargs = argc - i;
+    if (src.nargs == 0 && src.nfiles == 0) {
+        static char dash[] = "-";
+        files[src.nfiles++] = dash;
+    }
+
+    if (packet_size < (int)MIN_STATELESS_PACKET_SIZE || packet_size > MAX_PING_DATA_SIZE ||
+            ttl < 1 || ttl > MAX_TTL || timeout < 1 || retries < 0 || retries > 254) {
+        fprintf(stderr, "pingsweep: packet size must be %d-%d, ttl 1-%d\n",
+                (int)MIN_STATELESS_PACKET_SIZE, MAX_PING_DATA_SIZE, MAX_TTL);
+        return usage();
+    }
+
+    // Round the window to a power of two so slot bits split cleanly
+    int slot_bits = 0;
+    while (slot_bits < MAX_WINDOW_BITS && (1 << slot_bits) < window)
+        ++slot_bits;
+    const USHORT slot_mask = USHORT((1 << slot_bits) - 1);
+    window = 1 << slot_bits;
+
+    WSAData wsaData;
+    if (WSAStartup(MAKEWORD(WINSOCK_VER_REQ_HIGH, WINSOCK_VER_REQ_LOW), &wsaData) != 0) {
+        fprintf(stderr, "pingsweep: winsock %d.%d unavailable\n",
+                WINSOCK_VER_REQ_HIGH, WINSOCK_VER_REQ_LOW);
+        return 1;
+    }
+
+    probekey key;
+    SOCKET sd;
+    int rc;
+    u_long nonblocking = 1;
+    int sockbuf = SOCKET_BUFFER_SIZE;
+
+    if ((rc = init_probe_key(key)) != WSASUCCESS ||
+            (rc = setup_socket(ttl, sd, timeout)) != WSASUCCESS ||
+            ioctlsocket(sd, FIONBIO, &nonblocking) == SOCKET_ERROR) {
+        fprintf(stderr, "pingsweep: socket setup failed [0x%.4x]\n",
+                rc ? rc : WSAGetLastError());
+        WSACleanup();
+        return 1;
+    }
+
+    // A burst of replies must not overflow the socket while we send
+    setsockopt(sd, SOL_SOCKET, SO_RCVBUF, (const char*)&sockbuf, sizeof(sockbuf));
+    setsockopt(sd, SOL_SOCKET, SO_SNDBUF, (const char*)&sockbuf, sizeof(sockbuf));
+
+    ICMPHeader * send_buf = NULL;
+    IPHeader * recv_buf = NULL;
+    probeslot * slots = new probeslot[window];
+    int * free_slots = new int[window];
+    int nfree = window;
+
+    if (allocate_buffers(send_buf, recv_buf, packet_size) != WSASUCCESS) {
+        fprintf(stderr, "pingsweep: out of memory\n");
+        return 1;
+    }
+
+    for (int s = 0; s < window; ++s) {
+        memset(&slots[s], 0, sizeof(probeslot));
+        free_slots[s] = window - 1 - s;
+    }
+
+    sweepcounts counts;
+    memset(&counts, 0, sizeof(counts));
+
+    if (out_format == FORMAT_CSV)
+        out_str("addr,status,rtt_us,ttl\n");
+
+    const ULONGLONG timeout_us = ULONGLONG(timeout) * 1000;
+    const ULONGLONG start_us = timestamp_us();
+    ULONGLONG next_summary = start_us + ULONGLONG(summary_secs) * 1000000;
+    ULONGLONG next_scan = start_us;
+    ULONGLONG send_credit_at = start_us;    // Rate limiter, next send allowed
+    const ULONGLONG send_gap_us = pps ? 1000000 / pps : 0;
+
+    bool input_done = false;
+    bool have_dest = false;
+    sockaddr_in dest;
+    pingreq pr;
+
+    while (!input_done || have_dest || nfree < window) {
+        ULONGLONG now = timestamp_us();
+
+        // Fill the window from the input, as far as the rate allows
+        while (nfree && (send_gap_us == 0 || now >= send_credit_at)) {
+            if (!have_dest) {
+                if (input_done || !next_dest(src, dest)) {
+                    input_done = true;
+                    break;
+                }
+                have_dest = true;
+                ++counts.targets;
+            }
+
+            int s = free_slots[nfree - 1];
+            probeslot& slot = slots[s];
+            USHORT seq = USHORT((((slot.seq >> slot_bits) + 1) << slot_bits) | s);
+
+            init_stateless_packet(send_buf, packet_size, seq, dest, key);
+            rc = send_ping(sd, dest, send_buf, packet_size, NULL);
+            if (rc == WSAEWOULDBLOCK)
+                break;
+
+            have_dest = false;
+            if (rc != WSASUCCESS) {
+                // Refused locally, e.g. no route
+                emit_result(dest.sin_addr.s_addr, false, 0, 0);
+                ++counts.unreachable;
+                continue;
+            }
+
+            --nfree;
+            slot.ip = dest.sin_addr.s_addr;
+            slot.sent_us = timestamp_us();
+            slot.seq = seq;
+            slot.tries = 1;
+            slot.busy = true;
+            ++counts.sent;
+
+            if (send_gap_us)
+                send_credit_at = max(send_credit_at + send_gap_us, now);
+        }
+
+        // Wait briefly for replies, never past the next send credit
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        FD_SET(sd, &rfds);
+        timeval tv = { 0, MAX_WAIT_US };
+        if (send_gap_us && nfree && !input_done && send_credit_at > now)
+            tv.tv_usec = long(min(ULONGLONG(MAX_WAIT_US), send_credit_at - now));
+        select(0, &rfds, NULL, NULL, &tv);
+
+        sockaddr_in source;
+        while (recv_ping(sd, source, recv_buf, RECV_DATA_SIZE(packet_size), &pr) == WSASUCCESS) {
+            rc = decode_stateless_reply(recv_buf, pr.bytes_recv, &source,
+                                        key, timeout_us, &pr);
+            if (rc == EPROBE_MAC_INVALID || rc == EPROBE_STALE)
+                ++counts.rejected;
+            if (rc != WSASUCCESS)
+                continue;
+
+            // Only the slot's current occupant counts, not a retried
+            // or recycled probe's earlier reply
+            probeslot& slot = slots[pr.seq & slot_mask];
+            if (!slot.busy || slot.seq != USHORT(pr.seq) || slot.ip != pr.dest_ip)
+                continue;
+
+            emit_result(slot.ip, true, pr.rtt_us, pr.ttl);
+            ++counts.alive;
+            slot.busy = false;
+            free_slots[nfree++] = int(pr.seq & slot_mask);
+        }
+
+        // Expire, or retry, probes past their timeout
+        now = timestamp_us();
+        if (now >= next_scan) {
+            for (int s = 0; s < window; ++s) {
+                probeslot& slot = slots[s];
+                if (!slot.busy || now - slot.sent_us < timeout_us)
+                    continue;
+
+                if (slot.tries <= retries) {
+                    // Retries count against -p like first probes do;
+                    // without a credit the slot waits for a later scan
+                    if (send_gap_us && now < send_credit_at)
+                        continue;
+
+                    sockaddr_in again;
+                    memset(&again, 0, sizeof(again));
+                    again.sin_family = AF_INET;
+                    again.sin_addr.s_addr = slot.ip;
+
+                    USHORT seq = USHORT((((slot.seq >> slot_bits) + 1) << slot_bits) | s);
+                    init_stateless_packet(send_buf, packet_size, seq, again, key);
+                    rc = send_ping(sd, again, send_buf, packet_size, NULL);
+                    if (rc == WSASUCCESS) {
+                        slot.seq = seq;
+                        slot.sent_us = now;
+                        ++slot.tries;
+                        ++counts.sent;
+                        if (send_gap_us)
+                            send_credit_at = max(send_credit_at + send_gap_us, now);
+                        continue;
+                    }
+
+                    // The send buffer is full, the slot stays busy and
+                    // the retry goes out on a later scan
+                    if (rc == WSAEWOULDBLOCK)
+                        continue;
+                }
+
+                emit_result(slot.ip, false, 0, 0);
+                ++counts.unreachable;
+                slot.busy = false;
+                free_slots[nfree++] = s;
+            }
+            next_scan = now + MAX_WAIT_US;
+        }
+
+        if (summary_secs && now >= next_summary) {
+            out_flush();
+            print_summary(counts, window - nfree, now - start_us);
+            next_summary = now + ULONGLONG(summary_secs) * 1000000;
+        }
+    }
+
+    out_flush();
+    fflush(stdout);
+    if (summary_secs)
+        print_summary(counts, 0, timestamp_us() - start_us);
+
+    // Cleanup
+    closesocket(sd);
+    delete[] send_buf;
+    delete[] recv_buf;
+    delete[] slots;
+    delete[] free_slots;
+    delete[] files;
+    WSACleanup();
+
+    return src.bad_lines ? 1 : 0;
+}
@@ -0,0 +1,170 @@
+/***********************************************************************
+ pkttrain.cpp - Packet train / packet pair probing for bottleneck
+    capacity, dispersion and queueing delay.
+***********************************************************************/
+
+#include <pkttrain.h>
+#include <algorithm>
+
+//////////////////////////// train_estimates ///////////////////////////
+// Derives the delay and capacity figures from the recorded timings.
+
+static void train_estimates(trainresult& out)
+{
+    out.min_rtt_us = 0xffffffff;
+    for (int i = 0; i < out.count; ++i) {
+        const trainprobe& p = out.probes[i];
+        if (p.answered && p.recv_us - p.sent_us < out.min_rtt_us)
+            out.min_rtt_us = ULONG(p.recv_us - p.sent_us);
+    }
+
+    ULONGLONG queued = 0;
+    ULONGLONG first_recv = 0, last_recv = 0;
+    int first = -1;
+
+    for (int i = 0; i < out.count; ++i) {
+        const trainprobe& p = out.probes[i];
+        if (!p.answered)
+            continue;
+
+        ULONG queue = ULONG(p.recv_us - p.sent_us) - out.min_rtt_us;
+        queued += queue;
+        if (queue > out.max_queue_us)
+            out.max_queue_us = queue;
+
+        if (first < 0 || p.recv_us < first_recv) {
+            first_recv = p.recv_us;
+            first = i;
+        }
+        if (p.recv_us > last_recv)
+            last_recv = p.recv_us;
+    }
+
+    if (out.received)
+        out.avg_queue_us = ULONG(queued / out.received);
+    out.dispersion_us = last_recv - first_recv;
+
+    // Whole train: everything that arrived after the first reply had to
+    // squeeze through the bottleneck within the dispersion
+    if (out.dispersion_us) {
+        ULONGLONG bits = 0;
+        for (int i = 0; i < out.count; ++i)
+            if (out.probes[i].answered && i != first)
+                bits += ULONGLONG(out.probes[i].size + sizeof(IPHeader)) * 8;
+        out.train_bps = bits * 1000000 / out.dispersion_us;
+    }
+
+    // Packet pairs: adjacent probes that both came back in order.  The
+    // second one's size over the arrival gap is one capacity sample.
+    ULONGLONG pairs[MAX_TRAIN_LENGTH];
+    int npairs = 0;
+    for (int i = 1; i < out.count; ++i) {
+        const trainprobe& a = out.probes[i-1];
+        const trainprobe& b = out.probes[i];
+        if (!a.answered || !b.answered || b.recv_us <= a.recv_us)
+            continue;
+
+        ULONGLONG bits = ULONGLONG(b.size + sizeof(IPHeader)) * 8;
+        pairs[npairs++] = bits * 1000000 / (b.recv_us - a.recv_us);
+    }
+
+    if (npairs) {
+        std::sort(pairs, pairs + npairs);
+        out.capacity_bps = pairs[npairs / 2];
+    }
+}
+
+///////////////////////////// packet_train /////////////////////////////
+
+int packet_train(SOCKET sd, const sockaddr_in& dest, const int* sizes,
+                 int count, int timeout, trainresult& out)
+{
+    memset(&out, 0, sizeof(out));
+    if (count < 1 || count > MAX_TRAIN_LENGTH)
+        return EPACKET_SIZE_OUT_OF_BOUNDS ^ (count & 0xffff);
+
+    int largest = 0;
+    size_t total = 0;
+    for (int i = 0; i < count; ++i) {
+        largest = max(largest, sizes[i]);
+        total += sizes[i];
+    }
+
+    // Every packet ready before the first leaves
+    char* packets;
+    IPHeader* recv_buf;
+    if ((packets = new char[total]) == NULL)
+        return EBUFFER_ALLOCATION_FAILED;
+    if ((recv_buf = (IPHeader*)new char[RECV_DATA_SIZE(largest) +
+                                        sizeof(IPHeader)]) == NULL) {
+        delete[] packets;
+        return EBUFFER_ALLOCATION_FAILED;
+    }
+
+    const USHORT pid = (USHORT)GetCurrentProcessId();
+    const USHORT first_seq = (USHORT)GetTickCount();
+
+    ICMPHeader* hdrs[MAX_TRAIN_LENGTH];
+    char* at = packets;
+    for (int i = 0; i < count; ++i) {
+        hdrs[i] = (ICMPHeader*)at;
+        init_ping_packet(hdrs[i], sizes[i], USHORT(first_seq + i), NULL);
+        out.probes[i].size = sizes[i];
+        at += sizes[i];
+    }
+    out.count = count;
+
+    int rc = WSASUCCESS;
+    for (int i = 0; i < count && rc == WSASUCCESS; ++i) {
+        out.probes[i].sent_us = timestamp_us();
+        rc = send_packet(sd, dest, hdrs[i], sizes[i], NULL);
+    }
+
+    ULONGLONG deadline = timestamp_us() + ULONGLONG(timeout) * 1000;
+    ULONGLONG now;
+
+    while (rc == WSASUCCESS && out.received < count &&
+           (now = timestamp_us()) < deadline) {
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        FD_SET(sd, &rfds);
+        timeval tv;
+        tv.tv_sec = long((deadline - now) / 1000000);
+        tv.tv_usec = long((deadline - now) % 1000000);
+
+        if (select(0, &rfds, NULL, NULL, &tv) <= 0)
+            break;
+
+        sockaddr_in from;
+        pingreq pr;
+        if (recv_ping(sd, from, recv_buf, RECV_DATA_SIZE(largest), &pr) != WSASUCCESS)
+            continue;
+        ULONGLONG recv_us = timestamp_us();
+
+        unsigned short header_len = recv_buf->h_len * 4;
+        ICMPHeader* icmphdr = (ICMPHeader*)((char*)recv_buf + header_len);
+        if (int(pr.bytes_recv) < header_len + ICMP_MIN ||
+                icmphdr->type != ICMP_ECHO_REPLY || icmphdr->id != pid ||
+                from.sin_addr.s_addr != dest.sin_addr.s_addr)
+            continue;
+
+        USHORT idx = USHORT(icmphdr->seq - first_seq);
+        if (idx >= count || out.probes[idx].answered)
+            continue;
+
+        out.probes[idx].recv_us = recv_us;
+        out.probes[idx].answered = true;
+        ++out.received;
+    }
+
+    delete[] packets;
+    delete[] (char*)recv_buf;
+
+    if (rc != WSASUCCESS)
+        return rc;
+    if (!out.received)
+        return WSAETIMEDOUT;
+
+    train_estimates(out);
+    return WSASUCCESS;
+}
@@ -0,0 +1,50 @@
+/***********************************************************************
+ pkttrain.h - Declares the packet train probe, which sends a burst of
+    back-to-back echo requests and infers bottleneck capacity and
+    queueing delay from how the replies come back.
+***********************************************************************/
+
+#ifndef _PKTTRAIN_H_
+#define _PKTTRAIN_H_
+
+#include <rawping.h>
+
+#define MAX_TRAIN_LENGTH        64
+#define DEFAULT_TRAIN_TIMEOUT   2000
+
+typedef struct _train_probe_ {
+    int         size;           // ICMP bytes, as passed to send_ping
+    ULONGLONG   sent_us;        // timestamp_us() just before sending
+    ULONGLONG   recv_us;        // timestamp_us() as the reply was read
+    bool        answered;
+} trainprobe;
+
+typedef struct _train_result_ {
+    int         count;
+    int         received;
+    trainprobe  probes[MAX_TRAIN_LENGTH];
+    ULONG       min_rtt_us;
+    ULONG       max_queue_us;   // Largest RTT above min_rtt_us
+    ULONG       avg_queue_us;   // Mean RTT above min_rtt_us
+    ULONGLONG   dispersion_us;  // First to last reply arrival
+    ULONGLONG   capacity_bps;   // Median packet-pair estimate, 0 if none
+    ULONGLONG   train_bps;      // IP bits after the first reply / dispersion
+} trainresult;
+
+/** Sends count echo requests of the given ICMP sizes to dest back to
+ *  back over sd, collects replies until all arrive or timeout ms pass,
+ *  and fills out with the per packet timings and estimates.
+ *  Every packet is built before the first is sent, so nothing but
+ *  sendto() separates them. Capacity is the median packet-pair
+ *  estimate (size / arrival gap); the train as a whole gives a
+ *  dispersion rate, which falls below capacity under cross traffic.
+ *  Echo replies cross the path twice, so both describe the narrower
+ *  direction, and user space timestamps limit how high a capacity a
+ *  few microseconds of jitter can resolve for the chosen sizes.
+ *  Returns : WSASUCCESS, WSAETIMEDOUT if nothing came back, or the
+ *            socket error that stopped the train.
+ */
+extern int  packet_train(SOCKET sd, const sockaddr_in& dest, const int* sizes,
+                         int count, int timeout, trainresult& out);
+
+#endif /* _PKTTRAIN_H_ */
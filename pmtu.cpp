@@ -0,0 +1,194 @@
+/***********************************************************************
+ pmtu.cpp - Parallel path MTU discovery.  Probes are plain echo
+    requests sized to the IP datagram under test, sent with DF set.
+***********************************************************************/
+
+#include <pmtu.h>
+
+#define PROBE_PENDING   0
+#define PROBE_OK        1
+#define PROBE_TOO_BIG   2
+
+////////////////////////////// pmtu_lookup /////////////////////////////
+
+bool pmtu_lookup(pmtucache& cache, ULONG ip, int& mtu)
+{
+    std::map<ULONG, pmtuentry>::iterator it = cache.entries.find(ip);
+    if (it == cache.entries.end())
+        return false;
+
+    if (GetTickCount() - it->second.found_at > cache.max_age_ms) {
+        cache.entries.erase(it);
+        return false;
+    }
+
+    mtu = it->second.mtu;
+    return true;
+}
+
+///////////////////////////// probe_index //////////////////////////////
+// Maps the seq of a probe back to its slot in the current round.
+
+static int probe_index(USHORT seq, USHORT first_seq, int count)
+{
+    USHORT idx = USHORT(seq - first_seq);
+    return idx < count ? idx : -1;
+}
+
+///////////////////////////// pmtu_discover ////////////////////////////
+
+int pmtu_discover(SOCKET sd, const sockaddr_in& dest, pmtucache& cache,
+                  int& mtu, int lo, int hi, int timeout)
+{
+    if (pmtu_lookup(cache, dest.sin_addr.s_addr, mtu))
+        return WSASUCCESS;
+
+    int largest = hi - sizeof(IPHeader);
+    ICMPHeader* send_buf = NULL;
+    IPHeader* reply = NULL;
+
+    // Each reply is dealt with before the next is read, so one receive
+    // buffer sized for the largest probe will do
+    if (allocate_buffers(send_buf, reply, largest) != WSASUCCESS) {
+        delete[] send_buf;
+        delete[] (char*)reply;
+        return EBUFFER_ALLOCATION_FAILED;
+    }
+
+    const USHORT pid = (USHORT)GetCurrentProcessId();
+    USHORT seq = (USHORT)GetTickCount();
+
+    int good = lo;          // Largest size known to get through
+    int bad = hi + 1;       // Smallest size known not to
+    bool answered = false;
+    int rc = WSASUCCESS;
+
+    for (int round = 0; round < MAX_PMTU_ROUNDS && bad - good > 1 &&
+                        rc == WSASUCCESS; ++round) {
+        // Spread this round's probes evenly over the open interval
+        int sizes[PMTU_PROBES_PER_ROUND];
+        BYTE state[PMTU_PROBES_PER_ROUND];
+        int count = 0;
+
+        for (int i = 0; i < PMTU_PROBES_PER_ROUND; ++i) {
+            int size = good + (bad - good) * (i + 1) / (PMTU_PROBES_PER_ROUND + 1);
+            if (size <= good || (count && size == sizes[count-1]))
+                continue;
+            sizes[count] = size;
+            state[count++] = PROBE_PENDING;
+        }
+
+        USHORT first_seq = seq;
+        for (int i = 0; i < count && rc == WSASUCCESS; ++i) {
+            int packet_size = sizes[i] - sizeof(IPHeader);
+            init_ping_packet(send_buf, packet_size, USHORT(first_seq + i), NULL);
+
+            // Bigger than the local interface MTU never leaves the host
+            rc = send_ping(sd, dest, send_buf, packet_size, NULL);
+            if (rc == WSAEMSGSIZE) {
+                state[i] = PROBE_TOO_BIG;
+                rc = WSASUCCESS;
+            }
+        }
+        seq = USHORT(first_seq + count);
+
+        int pending = 0;
+        for (int i = 0; i < count; ++i)
+            pending += state[i] == PROBE_PENDING;
+
+        int hint = 0;
+        ULONGLONG deadline = timestamp_us() + ULONGLONG(timeout) * 1000;
+        ULONGLONG now;
+
+        while (rc == WSASUCCESS && pending && (now = timestamp_us()) < deadline) {
+            fd_set rfds;
+            FD_ZERO(&rfds);
+            FD_SET(sd, &rfds);
+            timeval tv;
+            tv.tv_sec = long((deadline - now) / 1000000);
+            tv.tv_usec = long((deadline - now) % 1000000);
+
+            if (select(0, &rfds, NULL, NULL, &tv) <= 0)
+                break;
+
+            sockaddr_in from;
+            pingreq pr;
+            if (recv_ping(sd, from, reply, RECV_DATA_SIZE(largest), &pr) != WSASUCCESS)
+                continue;
+
+            int bytes = pr.bytes_recv;
+            unsigned short header_len = reply->h_len * 4;
+            ICMPHeader* icmphdr = (ICMPHeader*)((char*)reply + header_len);
+            if (bytes < header_len + ICMP_MIN)
+                continue;
+
+            int idx = -1;
+            if (icmphdr->type == ICMP_ECHO_REPLY) {
+                if (icmphdr->id != pid ||
+                        from.sin_addr.s_addr != dest.sin_addr.s_addr)
+                    continue;
+
+                idx = probe_index(icmphdr->seq, first_seq, count);
+                if (idx >= 0 && state[idx] == PROBE_PENDING) {
+                    state[idx] = PROBE_OK;
+                    answered = true;
+                    --pending;
+                }
+            }
+            else if (icmphdr->type == ICMP_DEST_UNREACH &&
+                     icmphdr->code == ICMP_FRAG_NEEDED) {
+                // Quotes our IP header and the first 8 bytes of the probe
+                IPHeader* quoted = (IPHeader*)((char*)icmphdr + ICMP_MIN);
+                if (bytes < header_len + ICMP_MIN + int(sizeof(IPHeader)))
+                    continue;
+
+                unsigned short quoted_len = quoted->h_len * 4;
+                ICMPHeader* probe = (ICMPHeader*)((char*)quoted + quoted_len);
+                if (bytes < header_len + ICMP_MIN + quoted_len + ICMP_MIN ||
+                        probe->id != pid)
+                    continue;
+
+                idx = probe_index(probe->seq, first_seq, count);
+                if (idx >= 0 && state[idx] == PROBE_PENDING) {
+                    state[idx] = PROBE_TOO_BIG;
+                    --pending;
+                }
+
+                // RFC 1191 routers report their next-hop MTU in the
+                // second half of the unused word, i.e. our seq field
+                int next_hop = ntohs(icmphdr->seq);
+                if (next_hop > good && (!hint || next_hop < hint))
+                    hint = next_hop;
+            }
+        }
+
+        // Anything still pending was lost, which is a black hole as far
+        // as this search is concerned
+        for (int i = 0; i < count; ++i)
+            if (state[i] == PROBE_OK && sizes[i] > good)
+                good = sizes[i];
+        for (int i = 0; i < count; ++i)
+            if (state[i] != PROBE_OK && sizes[i] > good && sizes[i] < bad)
+                bad = sizes[i];
+        if (hint > good && hint + 1 < bad)
+            bad = hint + 1;
+    }
+
+    if (rc == WSASUCCESS) {
+        if (answered) {
+            mtu = good;
+
+            pmtuentry e;
+            e.mtu = good;
+            e.found_at = GetTickCount();
+            cache.entries[dest.sin_addr.s_addr] = e;
+        }
+        else
+            rc = WSAETIMEDOUT;
+    }
+
+    delete[] send_buf;
+    delete[] (char*)reply;
+
+    return rc;
+}
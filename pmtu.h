@@ -0,0 +1,53 @@
+/***********************************************************************
+ pmtu.h - Declares the path MTU discovery engine and its per
+    destination result cache.
+***********************************************************************/
+
+#ifndef _PMTU_H_
+#define _PMTU_H_
+
+#include <rawping.h>
+#include <map>
+
+// ICMP_DEST_UNREACH code sent when DF stops a packet being forwarded
+#define ICMP_FRAG_NEEDED        4
+
+#define MIN_PMTU                68
+#define DEFAULT_PMTU_MAX        9000
+#define DEFAULT_PMTU_TIMEOUT_MS 1000
+#define DEFAULT_PMTU_CACHE_MS   600000
+#define PMTU_PROBES_PER_ROUND   8
+#define MAX_PMTU_ROUNDS         10
+
+typedef struct _pmtu_entry_ {
+    int     mtu;
+    DWORD   found_at;           // GetTickCount() of the discovery
+} pmtuentry;
+
+typedef struct _pmtu_cache_ {
+    std::map<ULONG, pmtuentry> entries;     // Keyed by address, network byte order
+    DWORD   max_age_ms;
+
+    _pmtu_cache_() : max_age_ms(DEFAULT_PMTU_CACHE_MS) {}
+} pmtucache;
+
+/** Looks up a cached path MTU for ip that is younger than max_age_ms.
+ *  Returns false if there is none.
+ */
+extern bool pmtu_lookup(pmtucache& cache, ULONG ip, int& mtu);
+
+/** Searches for the path MTU towards dest between lo and hi bytes of
+ *  IP datagram, using sd which must already have DF set. A cached
+ *  result is returned without probing. Each round sends several DF
+ *  probes of different sizes at once and narrows [largest answered,
+ *  smallest refused), so a 68-9000 byte search takes about four
+ *  rounds. Fragmentation Needed shrinks the bound to the MTU the
+ *  router reports; unanswered sizes count as refused, which is what
+ *  finds black holes that drop DF packets silently.
+ *  Returns : WSASUCCESS with mtu set, WSAETIMEDOUT if no probe was ever
+ *            answered, or the socket error that stopped the search.
+ */
+extern int  pmtu_discover(SOCKET sd, const sockaddr_in& dest, pmtucache& cache,
+                          int& mtu, int lo, int hi, int timeout);
+
+#endif /* _PMTU_H_ */
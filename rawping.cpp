@@ -6,10 +6,21 @@
 
 #include <rawping.h>
 #include <ip_checksum.h>
+#include <siphash.h>
+#include <wincrypt.h>
 #include <iostream>
 
+// SSE2 is always there on x64, and on x86 when built with /arch:SSE2
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RAWPING_SSE2
+#include <emmintrin.h>
+#endif
+
+#pragma comment(lib,"Advapi32.lib")
+
 /////////////////////////// allocate_buffers ///////////////////////////
-// Allocates send and receive buffers.  Returns < 0 for failure.
+// Allocates send and receive buffers.  The receive buffer is sized
+// from packet_size, see RECV_DATA_SIZE.  Returns < 0 for failure.
 
 int allocate_buffers(ICMPHeader*& send_buf, IPHeader*& recv_buf,
                         int packet_size)
@@ -19,21 +30,21 @@ int allocate_buffers(ICMPHeader*& send_buf, IPHeader*& recv_buf,
         return EBUFFER_ALLOCATION_FAILED;
 
     // And then the receive buffer
-    if ((recv_buf = (IPHeader*)new char[MAX_PING_PACKET_SIZE]) == NULL)
+    if ((recv_buf = (IPHeader*)new char[RECV_DATA_SIZE(packet_size) +
+                                        sizeof(IPHeader)]) == NULL)
         return EBUFFER_ALLOCATION_FAILED;
 
     return WSASUCCESS;
 }
 
-//////////////////////////// setup_for_ping ////////////////////////////
-// Creates the Winsock structures necessary for sending and recieving
-// ping packets.  host can be either a dotted-quad IP address, or a
-// host name.  ttl is the time to live (a.k.a. number of hops) for the
-// packet.  The other two parameters are outputs from the function.
+///////////////////////////// setup_socket /////////////////////////////
+// Creates the raw ICMP socket used for sending and receiving ping
+// packets, and applies the ttl and send/recv timeouts to it.  This is
+// the part of setup_for_ping that does not depend on the destination,
+// so callers that already hold a numeric address can skip resolution.
 // Returns < 0 for failure.
 
-int setup_for_ping(const char* host, int ttl, SOCKET& sd, sockaddr_in& dest,
-                    int timeout, pingreq* pr)
+int setup_socket(int ttl, SOCKET& sd, int timeout)
 {
     // Create the socket
     sd = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
@@ -53,6 +64,37 @@ int setup_for_ping(const char* host, int ttl, SOCKET& sd, sockaddr_in& dest,
             sizeof(timeout)) == SOCKET_ERROR)
         return WSAGetLastError();
 
+    return WSASUCCESS;
+}
+
+/////////////////////////// set_dont_fragment //////////////////////////
+// Sets or clears the Don't Fragment bit on everything sent through sd.
+// Returns < 0 for failure.
+
+int set_dont_fragment(SOCKET sd, bool df)
+{
+    DWORD flag = df ? 1 : 0;
+    if (setsockopt(sd, IPPROTO_IP, IP_DONTFRAGMENT, (const char*)&flag,
+            sizeof(flag)) == SOCKET_ERROR)
+        return WSAGetLastError();
+
+    return WSASUCCESS;
+}
+
+//////////////////////////// setup_for_ping ////////////////////////////
+// Creates the Winsock structures necessary for sending and recieving
+// ping packets.  host can be either a dotted-quad IP address, or a
+// host name.  ttl is the time to live (a.k.a. number of hops) for the
+// packet.  The other two parameters are outputs from the function.
+// Returns < 0 for failure.
+
+int setup_for_ping(const char* host, int ttl, SOCKET& sd, sockaddr_in& dest,
+                    int timeout, pingreq* pr)
+{
+    int rc = setup_socket(ttl, sd, timeout);
+    if (rc != WSASUCCESS)
+        return rc;
+
     // Initialize the destination host info block
     memset(&dest, 0, sizeof(dest));
 
@@ -79,6 +121,8 @@ int setup_for_ping(const char* host, int ttl, SOCKET& sd, sockaddr_in& dest,
 
     if(pr)
     {
+        pr->dest_ip = dest.sin_addr.s_addr;
+
         // In format of ???.???.???.???
         if (addr != INADDR_NONE)
         {
@@ -179,9 +223,28 @@ void init_ping_packet(ICMPHeader* icmp_hdr, int packet_size, int seq_no,
 int send_ping(SOCKET sd, const sockaddr_in& dest, ICMPHeader* send_buf,
                 int packet_size, pingreq* pr)
 {
-    send_buf->timestamp = GetTickCount();
-    // Send the ping packet in send_buf as-is
-    int bwrote = sendto(sd, (char*)send_buf, packet_size, 0,
+    // Refresh the timestamp, and the checksum with it if it moved on
+    // since init_ping_packet() so the request doesn't go out corrupt
+    ULONG now = GetTickCount();
+    if (send_buf->timestamp != now) {
+        send_buf->timestamp = now;
+        send_buf->checksum = 0;
+        send_buf->checksum = ip_checksum((USHORT*)send_buf, packet_size);
+    }
+
+    return send_packet(sd, dest, send_buf, packet_size, pr);
+}
+
+
+////////////////////////////// send_packet /////////////////////////////
+// Sends the packet in send_buf exactly as it was built, for callers
+// that prepare their packets ahead of time and can't afford the
+// re-checksum send_ping() may do between sends.
+
+int send_packet(SOCKET sd, const sockaddr_in& dest, const ICMPHeader* send_buf,
+                int packet_size, pingreq* pr)
+{
+    int bwrote = sendto(sd, (const char*)send_buf, packet_size, 0,
             (sockaddr*)&dest, sizeof(dest));
 
     if (bwrote == SOCKET_ERROR)
@@ -221,53 +284,84 @@ int recv_ping(SOCKET sd, sockaddr_in& source, IPHeader* recv_buf,
 }
 
 
+////////////////////////////// hop_count ///////////////////////////////
+// Guesses how many hops a reply travelled from its remaining TTL,
+// assuming the sender started from 256.
+
+static int hop_count(BYTE ttl)
+{
+    int nHops = int(256 - ttl);
+    if (nHops == 192) {
+        // TTL came back 64, so ping was probably to a host on the
+        // LAN -- call it a single hop.
+        nHops = 1;
+    }
+    else if (nHops == 128) {
+        // Probably localhost
+        nHops = 0;
+    }
+    return nHops;
+}
+
 ///////////////////////////// decode_reply /////////////////////////////
 // Decode and output details about an ICMP reply packet.  Returns -1
-// on failure, -2 on "try again" and 0 on success.
+// on failure, -2 on "try again" and 0 on success.  Echo replies are
+// only accepted if their id is this process's, or id when given.
+// A raw socket sees every ICMP error on the host, so unreachable and
+// TTL expired messages are only accepted if they quote one of our
+// echo requests; pr->seq is then the quoted probe's seq.
 
 int decode_reply(IPHeader* reply, int bytes, sockaddr_in* from, pingreq* pr)
+{
+    return decode_reply(reply, bytes, from, pr, (USHORT)GetCurrentProcessId());
+}
+
+int decode_reply(IPHeader* reply, int bytes, sockaddr_in* from, pingreq* pr, USHORT id)
 {
     // Skip ahead to the ICMP header within the IP packet
     unsigned short header_len = reply->h_len * 4;
     ICMPHeader* icmphdr = (ICMPHeader*)((char*)reply + header_len);
+    USHORT seq = icmphdr->seq;
 
     // Make sure the reply is sane
     if (bytes < header_len + ICMP_MIN) {
         return ETOO_FEW_BYTES ^ bytes;
     }
     else if (icmphdr->type != ICMP_ECHO_REPLY) {
-        if (icmphdr->type != ICMP_TTL_EXPIRE) {
-            if (icmphdr->type == ICMP_DEST_UNREACH)
-                return WSAEHOSTUNREACH;
-            else
-                return EUNKNOWN_ICMP_PACKET ^ (int(icmphdr->type) & 0xffff);
+        if (icmphdr->type != ICMP_TTL_EXPIRE && icmphdr->type != ICMP_DEST_UNREACH)
+            return EUNKNOWN_ICMP_PACKET ^ (int(icmphdr->type) & 0xffff);
+
+        // Errors quote our IP header and the first 8 bytes of the probe
+        IPHeader* quoted = (IPHeader*)((char*)icmphdr + ICMP_MIN);
+        if (bytes < header_len + ICMP_MIN + int(sizeof(IPHeader)))
+            return WSATRY_AGAIN;
+
+        unsigned short quoted_len = quoted->h_len * 4;
+        ICMPHeader* probe = (ICMPHeader*)((char*)quoted + quoted_len);
+        if (bytes < header_len + ICMP_MIN + quoted_len + ICMP_MIN ||
+                probe->type != ICMP_ECHO_REQUEST || probe->id != id) {
+            // Someone else's error, e.g. a port unreachable for another
+            // process's UDP socket
+            return WSATRY_AGAIN;
         }
-        // If "TTL expired", fall through.  Next test will fail if we
-        // try it, so we need a way past it.
+        seq = probe->seq;
     }
-    else if (icmphdr->id != (USHORT)GetCurrentProcessId()) {
+    else if (icmphdr->id != id) {
         // Must be a reply for another pinger running locally, so just
         // ignore it.
         return WSATRY_AGAIN;
     }
 
     // Figure out how far the packet travelled
-    int nHops = int(256 - reply->ttl);
-    if (nHops == 192) {
-        // TTL came back 64, so ping was probably to a host on the
-        // LAN -- call it a single hop.
-        nHops = 1;
-    }
-    else if (nHops == 128) {
-        // Probably localhost
-        nHops = 0;
-    }
+    int nHops = hop_count(reply->ttl);
 
     // Okay, we ran the gamut, so the packet must be legal -- dump it
-    pr ? (pr->seq = icmphdr->seq) : 0;
+    pr ? (pr->seq = seq) : 0;
     pr ? (pr->hops = nHops) : 0;
     pr ? (pr->ttl = reply->ttl) : 0;
 
+    if (icmphdr->type == ICMP_DEST_UNREACH)
+        return WSAEHOSTUNREACH;
     if (icmphdr->type == ICMP_TTL_EXPIRE)
         return ETTL_EXPIRED ^ (ICMP_TTL_EXPIRE & 0xffff);
 
@@ -275,3 +369,250 @@ int decode_reply(IPHeader* reply, int bytes, sockaddr_in* from, pingreq* pr)
 
     return WSASUCCESS;
 }
+
+
+//////////////////////// payload_mismatch_scalar ///////////////////////
+// Counts the bytes that differ between a and b, one byte at a time.
+// Used for the tail of payload_mismatch and as its reference.
+
+size_t payload_mismatch_scalar(const void* a, const void* b, size_t n)
+{
+    const BYTE* pa = (const BYTE*)a;
+    const BYTE* pb = (const BYTE*)b;
+    size_t diff = 0;
+
+    for (size_t i = 0; i < n; ++i)
+        diff += pa[i] != pb[i];
+
+    return diff;
+}
+
+
+/////////////////////////// payload_mismatch ///////////////////////////
+// Counts the bytes that differ between a and b, 16 at a time.  Each
+// lane of acc counts equal bytes by subtracting the 0xff compare mask,
+// and is folded with a SAD before it can reach 255.
+
+size_t payload_mismatch(const void* a, const void* b, size_t n)
+{
+#ifdef RAWPING_SSE2
+    const BYTE* pa = (const BYTE*)a;
+    const BYTE* pb = (const BYTE*)b;
+    const __m128i zero = _mm_setzero_si128();
+    size_t blocks = n / 16;
+    size_t equal = 0;
+
+    while (blocks) {
+        size_t run = blocks < 255 ? blocks : 255;
+        __m128i acc = zero;
+
+        for (size_t i = 0; i < run; ++i, pa += 16, pb += 16) {
+            __m128i va = _mm_loadu_si128((const __m128i*)pa);
+            __m128i vb = _mm_loadu_si128((const __m128i*)pb);
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(va, vb));
+        }
+
+        __m128i sums = _mm_sad_epu8(acc, zero);
+        equal += _mm_cvtsi128_si32(sums) +
+                 _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+        blocks -= run;
+    }
+
+    size_t done = n & ~(size_t)15;
+    return (done - equal) + payload_mismatch_scalar(pa, pb, n - done);
+#else
+    return payload_mismatch_scalar(a, b, n);
+#endif
+}
+
+
+///////////////////////////// verify_reply /////////////////////////////
+// Checks an echo reply already accepted by decode_reply against the
+// request in sent: the ICMP checksum must hold, no bytes may be
+// missing, and payload bytes from offset onwards must match.  offset
+// is sizeof(ICMPHeader) for plain probes, and past the stamp for
+// stateless ones.  The counts are stored in results either way.
+// Returns EREPLY_TRUNCATED or EREPLY_CORRUPTED, each carrying the byte
+// count in the low word, or 0 if the reply is intact.
+
+int verify_reply(IPHeader* reply, int bytes, const ICMPHeader* sent,
+                 int packet_size, int offset, pingreq* pr)
+{
+    unsigned short header_len = reply->h_len * 4;
+    const char* icmp = (const char*)reply + header_len;
+    int icmp_len = bytes - header_len;
+
+    if (icmp_len < 0)
+        icmp_len = 0;
+
+    // A correct checksum sums to zero over the whole message
+    DWORD badsum = icmp_len && ip_checksum((USHORT*)icmp, icmp_len) != 0;
+    DWORD truncated = icmp_len < packet_size ? packet_size - icmp_len : 0;
+
+    int compare = min(icmp_len, packet_size) - offset;
+    DWORD mismatched = compare > 0 ?
+        DWORD(payload_mismatch(icmp + offset, (const char*)sent + offset, compare)) : 0;
+
+    if (pr) {
+        pr->bad_checksum = badsum;
+        pr->bytes_truncated = truncated;
+        pr->bytes_mismatched = mismatched;
+    }
+
+    if (truncated)
+        return EREPLY_TRUNCATED ^ (truncated & 0xffff);
+    if (badsum || mismatched)
+        return EREPLY_CORRUPTED ^ (mismatched & 0xffff);
+
+    return WSASUCCESS;
+}
+
+
+///////////////////////////// timestamp_us /////////////////////////////
+// Returns a monotonic timestamp in microseconds from the performance
+// counter.  Only differences between two values are meaningful.
+
+ULONGLONG timestamp_us(void)
+{
+    static LARGE_INTEGER freq = { 0 };
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+
+    // Split the division so the multiply can't overflow on long uptimes
+    ULONGLONG secs = now.QuadPart / freq.QuadPart;
+    ULONGLONG rem  = now.QuadPart % freq.QuadPart;
+    return secs * 1000000 + (rem * 1000000) / freq.QuadPart;
+}
+
+
+//////////////////////////// init_probe_key ////////////////////////////
+// Fills key with fresh random bits from the system CSP.  Every reply
+// is checked against this key, so it should stay private to the
+// process that sends the probes.  Returns < 0 for failure.
+
+int init_probe_key(probekey& key)
+{
+    HCRYPTPROV prov;
+    if (!CryptAcquireContext(&prov, NULL, NULL, PROV_RSA_FULL,
+            CRYPT_VERIFYCONTEXT | CRYPT_SILENT))
+        return GetLastError();
+
+    BOOL ok = CryptGenRandom(prov, sizeof(key), (BYTE*)&key);
+    DWORD rc = ok ? WSASUCCESS : GetLastError();
+    CryptReleaseContext(prov, 0);
+
+    return rc;
+}
+
+
+//////////////////////////// stamp_mac /////////////////////////////////
+// MAC over the fields of a stateless probe that a reply must echo back
+// unchanged.
+
+static ULONGLONG stamp_mac(USHORT id, USHORT seq, const ProbeStamp* stamp,
+                           const probekey& key)
+{
+    BYTE msg[sizeof(USHORT) * 2 + sizeof(ULONG) + sizeof(ULONGLONG)];
+    BYTE* p = msg;
+
+    memcpy(p, &id, sizeof(id));                     p += sizeof(id);
+    memcpy(p, &seq, sizeof(seq));                   p += sizeof(seq);
+    memcpy(p, &stamp->dest_ip, sizeof(ULONG));      p += sizeof(ULONG);
+    memcpy(p, &stamp->sent_us, sizeof(ULONGLONG));
+
+    return siphash24(msg, sizeof(msg), key.k0, key.k1);
+}
+
+
+///////////////////////// init_stateless_packet ////////////////////////
+// Builds an echo request like init_ping_packet, but places a ProbeStamp
+// for dest at the start of the payload.  packet_size must be at least
+// MIN_STATELESS_PACKET_SIZE.
+
+void init_stateless_packet(ICMPHeader* icmp_hdr, int packet_size, int seq_no,
+                           const sockaddr_in& dest, const probekey& key)
+{
+    init_ping_packet(icmp_hdr, packet_size, seq_no, NULL);
+
+    ProbeStamp stamp;
+    stamp.dest_ip = dest.sin_addr.s_addr;
+    stamp.sent_us = timestamp_us();
+    stamp.mac = stamp_mac(icmp_hdr->id, icmp_hdr->seq, &stamp, key);
+
+    memcpy((char*)icmp_hdr + sizeof(ICMPHeader), &stamp, sizeof(stamp));
+
+    // The payload changed, so the checksum has to be redone
+    icmp_hdr->checksum = 0;
+    icmp_hdr->checksum = ip_checksum((USHORT*)icmp_hdr, packet_size);
+}
+
+
+//////////////////////// decode_stateless_reply ////////////////////////
+// Decodes an echo reply to a stateless probe using nothing but the
+// packet itself.  The stamp's MAC must verify under key, the reply must
+// come from the address it was sent to, and it must be no older than
+// max_age_us.  Returns the same codes as decode_reply, plus
+// EPROBE_MAC_INVALID for forged or foreign replies and EPROBE_STALE
+// for replies that arrive too late.
+
+int decode_stateless_reply(IPHeader* reply, int bytes, sockaddr_in* from,
+                           const probekey& key, ULONGLONG max_age_us,
+                           pingreq* pr)
+{
+    // Skip ahead to the ICMP header within the IP packet
+    unsigned short header_len = reply->h_len * 4;
+    ICMPHeader* icmphdr = (ICMPHeader*)((char*)reply + header_len);
+
+    // Make sure the reply is sane
+    if (bytes < header_len + ICMP_MIN) {
+        return ETOO_FEW_BYTES ^ bytes;
+    }
+    else if (icmphdr->type != ICMP_ECHO_REPLY) {
+        // Error messages only quote 8 bytes of the original datagram,
+        // so the stamp never comes back with them
+        if (icmphdr->type == ICMP_DEST_UNREACH)
+            return WSAEHOSTUNREACH;
+        else if (icmphdr->type == ICMP_TTL_EXPIRE)
+            return ETTL_EXPIRED ^ (ICMP_TTL_EXPIRE & 0xffff);
+        else
+            return EUNKNOWN_ICMP_PACKET ^ (int(icmphdr->type) & 0xffff);
+    }
+    else if (icmphdr->id != (USHORT)GetCurrentProcessId()) {
+        // Must be a reply for another pinger running locally, so just
+        // ignore it.
+        return WSATRY_AGAIN;
+    }
+    else if (bytes < int(header_len + MIN_STATELESS_PACKET_SIZE)) {
+        return ETOO_FEW_BYTES ^ bytes;
+    }
+
+    ProbeStamp stamp;
+    memcpy(&stamp, (char*)icmphdr + sizeof(ICMPHeader), sizeof(stamp));
+
+    if (stamp.mac != stamp_mac(icmphdr->id, icmphdr->seq, &stamp, key))
+        return EPROBE_MAC_INVALID;
+
+    // A valid stamp answered by some other host is still not our reply
+    if (from && from->sin_addr.s_addr != stamp.dest_ip)
+        return EPROBE_MAC_INVALID;
+
+    ULONGLONG now = timestamp_us();
+    if (stamp.sent_us > now || now - stamp.sent_us > max_age_us)
+        return EPROBE_STALE;
+
+    if (pr) {
+        pr->dest_ip = stamp.dest_ip;
+        pr->packet_size = bytes - header_len;
+        pr->bytes_recv = bytes;
+        pr->seq = icmphdr->seq;
+        pr->ttl = reply->ttl;
+        pr->hops = hop_count(reply->ttl);
+        pr->timems = DWORD((now - stamp.sent_us) / 1000);
+        pr->rtt_us = ULONG(now - stamp.sent_us);
+    }
+
+    return WSASUCCESS;
+}
@@ -70,6 +70,14 @@
 #define ETTL_SIZE_OUT_OF_BOUNDS     0xe2200000
 #define EUNKNOWN_ICMP_PACKET        0xe3000000
 #define EBUFFER_ALLOCATION_FAILED   0xe4000000
+#define EPROBE_MAC_INVALID          0xe3100000
+#define EPROBE_STALE                0xe3200000
+#define EREPLY_CORRUPTED            0xe3300000
+#define EREPLY_TRUNCATED            0xe3400000
+#define ETARGET_SPEC_INVALID        0xe5000000
+#define ETARGET_SPACE_EMPTY         0xe5100000
+#define EPCAP_OPEN_FAILED           0xe6000000
+#define EPCAP_FORMAT                0xe6100000
 #define EWINSOCK_VERSION            0xef000000
 
 // Defines Winsock version requirements
@@ -120,6 +128,16 @@
 #define MAX_PING_DATA_SIZE      1024
 #define MAX_TTL                 255
 #define MAX_PING_PACKET_SIZE    (MAX_PING_DATA_SIZE + sizeof(IPHeader))
+#define MAX_IP_PACKET_SIZE      65535
+#define MAX_IP_HEADER_SIZE      60
+// Largest ICMP message that fits an IP datagram with no options
+#define MAX_LARGE_PING_DATA_SIZE    (MAX_IP_PACKET_SIZE - sizeof(IPHeader))
+// ICMP bytes the receive buffer for packet_size byte requests holds
+// past a plain IP header.  Never less than MAX_PING_DATA_SIZE, so
+// other pingers' replies and error messages still fit, and with room
+// for IP options.
+#define RECV_DATA_SIZE(ps)      (max(MAX_PING_DATA_SIZE, (ps)) + \
+                                    MAX_IP_HEADER_SIZE - sizeof(IPHeader))
 
 // The IP header
 struct IPHeader {
@@ -147,6 +165,24 @@ struct ICMPHeader {
 };
 
 
+// Stateless probe stamp, written at the start of the payload area.
+// Everything needed to rebuild a result travels with the packet, and
+// the MAC ties it to this process's key so forged replies fail.
+struct ProbeStamp {
+    ULONG dest_ip;          // Target in network byte order
+    ULONGLONG sent_us;      // timestamp_us() when the packet was built
+    ULONGLONG mac;          // SipHash-2-4 over id, seq, dest_ip and sent_us
+};
+
+#define MIN_STATELESS_PACKET_SIZE   (sizeof(ICMPHeader) + sizeof(ProbeStamp))
+#define DEFAULT_PROBE_MAX_AGE_US    60000000
+
+// 128 bit SipHash key for stateless probes
+typedef struct _probe_key_ {
+    ULONGLONG k0;
+    ULONGLONG k1;
+} probekey;
+
 typedef struct _ping_req_ {
     char *  hostname;
     char *  addr;
@@ -157,11 +193,18 @@ typedef struct _ping_req_ {
     DWORD   hops;
     DWORD   seq;
     DWORD   timems;
+    ULONG   dest_ip;        // Destination in network byte order
+    ULONG   rtt_us;         // Round trip in microseconds, 0 if unanswered
+    DWORD   bad_checksum;   // 1 if the reply's ICMP checksum failed
+    DWORD   bytes_mismatched;   // Echoed payload bytes differing from the request
+    DWORD   bytes_truncated;    // Request bytes missing from the reply
+    int     status;         // WSASUCCESS for a reply, else why there was none
 
     _ping_req_() : bytes_recv(0), bytes_sent(0),
                    packet_size(0), ttl(0), hops(0),
-                   seq(0), timems(0),
-                   hostname(NULL), addr(NULL) {}
+                   seq(0), timems(0), dest_ip(0), rtt_us(0),
+                   bad_checksum(0), bytes_mismatched(0), bytes_truncated(0),
+                   status(WSASUCCESS), hostname(NULL), addr(NULL) {}
     ~_ping_req_() {
         hostname ? free(hostname) : 0;
         addr ? free(addr) : 0;
@@ -173,10 +216,21 @@ typedef struct _ping_req_ {
 #endif
 
 extern int  allocate_buffers(ICMPHeader*& send_buf, IPHeader*& recv_buf, int packet_size);
+extern int  setup_socket(int ttl, SOCKET& sd, int timeout);
+extern int  set_dont_fragment(SOCKET sd, bool df);
 extern int  setup_for_ping(const char* host, int ttl, SOCKET& sd, sockaddr_in& dest, int timeout, pingreq* results);
 extern int  send_ping(SOCKET sd, const sockaddr_in& dest, ICMPHeader* send_buf, int packet_size, pingreq* results);
+extern int  send_packet(SOCKET sd, const sockaddr_in& dest, const ICMPHeader* send_buf, int packet_size, pingreq* results);
 extern int  recv_ping(SOCKET sd, sockaddr_in& source, IPHeader* recv_buf, int packet_size, pingreq* results);
 extern int  decode_reply(IPHeader* reply, int bytes, sockaddr_in* from, pingreq* results);
+extern int  decode_reply(IPHeader* reply, int bytes, sockaddr_in* from, pingreq* results, USHORT id);
 extern void init_ping_packet(ICMPHeader* icmp_hdr, int packet_size, int seq_no, pingreq* results);
+extern int  verify_reply(IPHeader* reply, int bytes, const ICMPHeader* sent, int packet_size, int offset, pingreq* results);
+extern size_t payload_mismatch(const void* a, const void* b, size_t n);
+extern size_t payload_mismatch_scalar(const void* a, const void* b, size_t n);
+extern ULONGLONG timestamp_us(void);
+extern int  init_probe_key(probekey& key);
+extern void init_stateless_packet(ICMPHeader* icmp_hdr, int packet_size, int seq_no, const sockaddr_in& dest, const probekey& key);
+extern int  decode_stateless_reply(IPHeader* reply, int bytes, sockaddr_in* from, const probekey& key, ULONGLONG max_age_us, pingreq* results);
 
 #endif /* _RAWPING_H_ */
@@ -0,0 +1,152 @@
+/***********************************************************************
+ rttest.cpp - Per-destination SRTT/RTTVAR estimators kept in a compact
+    open addressed table so state survives across ping() calls.
+***********************************************************************/
+
+#include <rttest.h>
+
+// Clock granularity term of RFC 6298, the RTO never hugs SRTT tighter
+#define RTO_GRANULARITY_US  1000
+
+/////////////////////////////// rtt_slot ///////////////////////////////
+// Fibonacci hash of the address onto a power of two table.  The top
+// bits of the product are the well mixed ones, and the address is
+// hashed in host order so hosts in one subnet spread across the table.
+
+static size_t rtt_slot(ULONG ip, size_t size)
+{
+    int bits = 0;
+    while ((size_t(1) << bits) < size)
+        ++bits;
+    if (bits == 0)
+        return 0;
+
+    ULONG h = ULONG(ntohl(ip) * 0x9e3779b1UL);
+    return size_t(h >> (32 - bits));
+}
+
+////////////////////////////// rtt_update //////////////////////////////
+// RFC 6298 section 2 update of a single estimator.
+
+static void rtt_update(rttentry& e, ULONG rtt_us)
+{
+    if (e.samples == 0) {
+        e.srtt_us = rtt_us;
+        e.rttvar_us = rtt_us / 2;
+    }
+    else {
+        ULONG delta = e.srtt_us > rtt_us ? e.srtt_us - rtt_us
+                                         : rtt_us - e.srtt_us;
+        e.rttvar_us = e.rttvar_us - (e.rttvar_us >> 2) + (delta >> 2);
+        e.srtt_us = e.srtt_us - (e.srtt_us >> 3) + (rtt_us >> 3);
+    }
+
+    if (e.samples != 0xffff)
+        ++e.samples;
+    e.misses = 0;
+}
+
+////////////////////////////// rtt_rehash //////////////////////////////
+// Doubles the table once it passes 3/4 full.
+
+static void rtt_rehash(rtttable& table)
+{
+    std::vector<rttentry> old;
+    old.swap(table.slots);
+
+    table.slots.resize(old.size() * 2);
+    memset(&table.slots[0], 0, table.slots.size() * sizeof(rttentry));
+
+    size_t mask = table.slots.size() - 1;
+    for (size_t i = 0; i < old.size(); ++i) {
+        if (old[i].ip == 0)
+            continue;
+
+        size_t s = rtt_slot(old[i].ip, table.slots.size());
+        while (table.slots[s].ip != 0)
+            s = (s + 1) & mask;
+        table.slots[s] = old[i];
+    }
+}
+
+/////////////////////////////// find_rtt ///////////////////////////////
+
+rttentry* find_rtt(rtttable& table, ULONG ip, bool create)
+{
+    // 0.0.0.0 is never a ping target, and marks empty slots
+    if (ip == 0)
+        return NULL;
+
+    if (create && (table.used + 1) * 4 > table.slots.size() * 3)
+        rtt_rehash(table);
+
+    size_t mask = table.slots.size() - 1;
+    size_t s = rtt_slot(ip, table.slots.size());
+    while (table.slots[s].ip != 0) {
+        if (table.slots[s].ip == ip)
+            return &table.slots[s];
+        s = (s + 1) & mask;
+    }
+
+    if (!create)
+        return NULL;
+
+    memset(&table.slots[s], 0, sizeof(rttentry));
+    table.slots[s].ip = ip;
+    ++table.used;
+    return &table.slots[s];
+}
+
+////////////////////////////// rtt_sample //////////////////////////////
+
+void rtt_sample(rtttable& table, ULONG ip, ULONG rtt_us)
+{
+    rttentry* e = find_rtt(table, ip, true);
+    if (e)
+        rtt_update(*e, rtt_us);
+
+    rtt_update(table.global, rtt_us);
+}
+
+////////////////////////////// rtt_timeout /////////////////////////////
+
+void rtt_timeout(rtttable& table, ULONG ip)
+{
+    rttentry* e = find_rtt(table, ip, true);
+    if (e && e->misses != 0xffff)
+        ++e->misses;
+}
+
+//////////////////////////// rtt_deadline_ms ///////////////////////////
+// RTO = SRTT + max(G, 4 * RTTVAR), from the host's own estimator when
+// it has one, otherwise from the aggregate, otherwise max_rto_ms.  The
+// backoff comes from the host's own run of misses either way.
+
+DWORD rtt_deadline_ms(rtttable& table, ULONG ip)
+{
+    const rttentry* e = find_rtt(table, ip, false);
+    int attempt = e ? e->misses : 0;
+    if (!e || e->samples == 0)
+        e = &table.global;
+
+    ULONGLONG rto_us;
+    if (e->samples == 0)
+        rto_us = ULONGLONG(table.max_rto_ms) * 1000;
+    else
+        rto_us = ULONGLONG(e->srtt_us) +
+                 max(ULONGLONG(RTO_GRANULARITY_US), ULONGLONG(e->rttvar_us) * 4);
+
+    if (attempt > MAX_RTO_BACKOFF)
+        attempt = MAX_RTO_BACKOFF;
+    if (attempt > 0)
+        rto_us <<= attempt;
+
+    // Round up so a sub-millisecond RTO still waits a whole tick
+    ULONGLONG rto_ms = (rto_us + 999) / 1000;
+    if (rto_ms < table.min_rto_ms)
+        rto_ms = table.min_rto_ms;
+    if (rto_ms > table.max_rto_ms)
+        rto_ms = table.max_rto_ms;
+
+    return DWORD(rto_ms);
+}
@@ -0,0 +1,67 @@
+/***********************************************************************
+ rttest.h - Declares the per-destination round trip time estimator
+    used to size each probe's deadline instead of one fixed timeout.
+***********************************************************************/
+
+#ifndef _RTTEST_H_
+#define _RTTEST_H_
+
+#include <rawping.h>
+#include <vector>
+
+#define DEFAULT_RTT_TABLE_SIZE  1024
+#define DEFAULT_MIN_RTO_MS      10
+#define DEFAULT_MAX_RTO_MS      4000
+#define MAX_RTO_BACKOFF         6
+
+// One estimator, 16 bytes so a cache line holds four hosts
+typedef struct _rtt_entry_ {
+    ULONG   ip;             // Network byte order, 0 marks an empty slot
+    ULONG   srtt_us;        // Smoothed round trip time
+    ULONG   rttvar_us;      // Round trip time variation
+    USHORT  samples;        // Replies seen, saturates at 0xffff
+    USHORT  misses;         // Consecutive timeouts since the last reply
+} rttentry;
+
+typedef struct _rtt_table_ {
+    std::vector<rttentry>   slots;      // Open addressed, power of two sized
+    size_t      used;
+    rttentry    global;                 // Aggregate over every host
+    DWORD       min_rto_ms;
+    DWORD       max_rto_ms;
+
+    _rtt_table_() : used(0), min_rto_ms(DEFAULT_MIN_RTO_MS),
+                    max_rto_ms(DEFAULT_MAX_RTO_MS)
+    {
+        memset(&global, 0, sizeof(global));
+        slots.resize(DEFAULT_RTT_TABLE_SIZE);
+        memset(&slots[0], 0, slots.size() * sizeof(rttentry));
+    }
+} rtttable;
+
+/** Returns the estimator for ip, or NULL if it has never been seen
+ *  and create is false.
+ */
+extern rttentry* find_rtt(rtttable& table, ULONG ip, bool create);
+
+/** Folds a measured round trip time into ip's estimator and the
+ *  aggregate, and clears its run of misses. SRTT and RTTVAR follow
+ *  RFC 6298 (alpha 1/8, beta 1/4).
+ */
+extern void rtt_sample(rtttable& table, ULONG ip, ULONG rtt_us);
+
+/** Records that a probe to ip went unanswered */
+extern void rtt_timeout(rtttable& table, ULONG ip);
+
+/** Returns how long to wait for the next reply from ip, in
+ *  milliseconds, clamped to [min_rto_ms, max_rto_ms]. A host without
+ *  a sample yet borrows the aggregate estimate built from every reply,
+ *  so a dead host on a fast LAN costs a few milliseconds rather than a
+ *  full fixed timeout. Every consecutive timeout recorded for ip
+ *  doubles the timeout, up to MAX_RTO_BACKOFF doublings. The run of
+ *  misses persists across calls, so a slow host that borrowed a too
+ *  tight estimate still gets answered.
+ */
+extern DWORD rtt_deadline_ms(rtttable& table, ULONG ip);
+
+#endif /* _RTTEST_H_ */
@@ -0,0 +1,148 @@
+/***********************************************************************
+ rtthist.cpp - Fixed-size multi-resolution RTT/loss rings per target,
+    written incrementally and read without locks.
+***********************************************************************/
+
+#include <rtthist.h>
+
+// Seconds per bucket, slots and first bucket of each level
+static const ULONG level_secs[HIST_LEVELS]  = { 1, 60, 3600 };
+static const ULONG level_slots[HIST_LEVELS] = { HIST_SECOND_SLOTS,
+                                                HIST_MINUTE_SLOTS,
+                                                HIST_HOUR_SLOTS };
+static const ULONG level_base[HIST_LEVELS]  = { 0,
+                                                HIST_SECOND_SLOTS,
+                                                HIST_SECOND_SLOTS + HIST_MINUTE_SLOTS };
+
+/////////////////////////////// rtt_bin ////////////////////////////////
+
+static int rtt_bin(ULONG rtt_us)
+{
+    int bin = 0;
+    ULONG edge = HIST_BIN_BASE_US;
+    while (bin < HIST_BINS - 1 && rtt_us >= edge) {
+        edge <<= 2;
+        ++bin;
+    }
+    return bin;
+}
+
+////////////////////////////// saturate ////////////////////////////////
+
+static void saturate_inc(USHORT& v)
+{
+    if (v != 0xffff)
+        ++v;
+}
+
+////////////////////////////// hist_target /////////////////////////////
+
+size_t hist_target(rtthistory& h, ULONG ip, bool create)
+{
+    std::map<ULONG, size_t>::iterator it = h.index.find(ip);
+    if (it != h.index.end())
+        return it->second;
+    if (!create)
+        return HIST_NO_TARGET;
+
+    histtarget t;
+    t.ip = ip;
+    t.version = 0;
+
+    size_t index = h.targets.size();
+    h.targets.push_back(t);
+
+    HistBucket empty;
+    memset(&empty, 0, sizeof(empty));
+    h.buckets.resize(h.buckets.size() + HIST_BUCKETS, empty);
+
+    h.index[ip] = index;
+    return index;
+}
+
+////////////////////////////// hist_record /////////////////////////////
+
+void hist_record(rtthistory& h, size_t index, ULONG now, bool lost, ULONG rtt_us)
+{
+    histtarget& t = h.targets[index];
+    HistBucket* run = &h.buckets[index * HIST_BUCKETS];
+    int bin = rtt_bin(rtt_us);
+
+    // Odd while writing, readers back off or retry
+    InterlockedIncrement(&t.version);
+
+    for (int level = 0; level < HIST_LEVELS; ++level) {
+        ULONG epoch = now / level_secs[level];
+        HistBucket& b = run[level_base[level] + epoch % level_slots[level]];
+
+        // The slot still holds an older lap of the ring, start it over
+        if (b.epoch != epoch) {
+            memset(&b, 0, sizeof(b));
+            b.epoch = epoch;
+            b.min_us = 0xffffffff;
+        }
+
+        saturate_inc(b.count);
+        if (lost) {
+            saturate_inc(b.lost);
+            continue;
+        }
+
+        if (rtt_us < b.min_us)
+            b.min_us = rtt_us;
+        if (rtt_us > b.max_us)
+            b.max_us = rtt_us;
+        b.sum_us += rtt_us;
+        saturate_inc(b.bins[bin]);
+    }
+
+    InterlockedIncrement(&t.version);
+}
+
+////////////////////////////// hist_query //////////////////////////////
+
+void hist_query(const rtthistory& h, size_t index, int level,
+                ULONG from, ULONG to, histsummary& out)
+{
+    const histtarget& t = h.targets[index];
+    const HistBucket* run = &h.buckets[index * HIST_BUCKETS + level_base[level]];
+    ULONG first = from / level_secs[level];
+    ULONG last = to / level_secs[level];
+    ULONG slots = level_slots[level];
+
+    for (;;) {
+        LONG before = t.version;
+        if (before & 1) {
+            YieldProcessor();
+            continue;
+        }
+        MemoryBarrier();
+
+        memset(&out, 0, sizeof(out));
+        out.min_us = 0xffffffff;
+
+        // Only the newest lap of each slot can match, so every slot is
+        // looked at once however wide the range
+        for (ULONG s = 0; s < slots; ++s) {
+            const HistBucket& b = run[s];
+            if (b.count == 0 || b.epoch < first || b.epoch > last)
+                continue;
+
+            out.count += b.count;
+            out.lost += b.lost;
+            out.sum_us += b.sum_us;
+            if (b.count != b.lost) {
+                if (b.min_us < out.min_us)
+                    out.min_us = b.min_us;
+                if (b.max_us > out.max_us)
+                    out.max_us = b.max_us;
+            }
+            for (int i = 0; i < HIST_BINS; ++i)
+                out.bins[i] += b.bins[i];
+        }
+
+        MemoryBarrier();
+        if (t.version == before)
+            break;
+    }
+}
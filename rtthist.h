@@ -0,0 +1,89 @@
+/***********************************************************************
+ rtthist.h - Declares the per-target RTT/loss history, kept at several
+    resolutions at once so "last minute / hour / day" queries never
+    have to re-aggregate raw samples.
+***********************************************************************/
+
+#ifndef _RTTHIST_H_
+#define _RTTHIST_H_
+
+#include <rawping.h>
+#include <vector>
+#include <map>
+
+#define HIST_LEVEL_SECONDS      0
+#define HIST_LEVEL_MINUTES      1
+#define HIST_LEVEL_HOURS        2
+#define HIST_LEVELS             3
+
+#define HIST_SECOND_SLOTS       60
+#define HIST_MINUTE_SLOTS       60
+#define HIST_HOUR_SLOTS         24
+#define HIST_BUCKETS            (HIST_SECOND_SLOTS + HIST_MINUTE_SLOTS + HIST_HOUR_SLOTS)
+
+// RTT histogram bins grow by 4x from 128us: <128us, <512us, <2ms,
+// <8ms, <32ms, <128ms, <512ms and everything slower
+#define HIST_BINS               8
+#define HIST_BIN_BASE_US        128
+
+#define HIST_NO_TARGET          ((size_t)-1)
+
+// 40 bytes.  Counters saturate rather than wrap.
+struct HistBucket {
+    ULONG       epoch;          // Start of the bucket in level units since 1970
+    USHORT      count;          // Probes, answered or not
+    USHORT      lost;
+    ULONG       min_us;
+    ULONG       max_us;
+    ULONGLONG   sum_us;         // Over answered probes
+    USHORT      bins[HIST_BINS];
+};
+
+typedef struct _hist_target_ {
+    ULONG           ip;             // Network byte order
+    volatile LONG   version;        // Odd while being written
+} histtarget;
+
+typedef struct _rtt_history_ {
+    std::vector<histtarget>     targets;
+    std::vector<HistBucket>     buckets;    // HIST_BUCKETS per target, in target order
+    std::map<ULONG, size_t>     index;      // ip to position in targets
+} rtthistory;
+
+// Aggregate of the buckets a query covered
+typedef struct _hist_summary_ {
+    ULONG       count;
+    ULONG       lost;
+    ULONG       min_us;         // 0xffffffff if nothing was answered
+    ULONG       max_us;
+    ULONGLONG   sum_us;
+    ULONG       bins[HIST_BINS];
+} histsummary;
+
+/** Returns the position of ip's history, adding it if create is set,
+ *  or HIST_NO_TARGET. Adding may move the bucket array, so targets
+ *  should all be added before readers start. Each target owns
+ *  HIST_BUCKETS adjacent buckets in one array shared by all targets,
+ *  about 5.6 KB, so 100k targets stay under 600 MB whatever the
+ *  sample rate, and a range scan walks sequential memory.
+ */
+extern size_t hist_target(rtthistory& h, ULONG ip, bool create);
+
+/** Records one probe result for the target at index at time now
+ *  (seconds since 1970). rtt_us is ignored when lost is set. The
+ *  current bucket of every level is updated at once, so there is no
+ *  separate rollup pass.
+ *  NB: Only one thread may write a given target.
+ */
+extern void hist_record(rtthistory& h, size_t index, ULONG now, bool lost, ULONG rtt_us);
+
+/** Sums the buckets of one level whose start lies in [from, to]
+ *  (seconds since 1970) and that are still held in the ring.
+ *  Safe to call while another thread records to the same target:
+ *  no lock is taken, instead the copy is retried if the target's
+ *  version was odd (mid-update) or moved while it was read.
+ */
+extern void hist_query(const rtthistory& h, size_t index, int level,
+                       ULONG from, ULONG to, histsummary& out);
+
+#endif /* _RTTHIST_H_ */
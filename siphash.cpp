@@ -0,0 +1,77 @@
+/***********************************************************************
+ siphash.cpp - Reference SipHash-2-4 (Aumasson & Bernstein).  Short
+    inputs are the common case here, so it is kept as a single pass
+    with no allocation.
+***********************************************************************/
+
+#include <siphash.h>
+
+#define ROTL64(x, b)    (ULONGLONG)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND                                            \
+    do {                                                    \
+        v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0;            \
+        v0 = ROTL64(v0, 32);                                \
+        v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2;            \
+        v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0;            \
+        v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2;            \
+        v2 = ROTL64(v2, 32);                                \
+    } while (0)
+
+////////////////////////////// read_le64 ///////////////////////////////
+// Loads 8 bytes as a little endian word regardless of alignment.
+
+static ULONGLONG read_le64(const BYTE* p)
+{
+    ULONGLONG w = 0;
+    for (int i = 7; i >= 0; --i)
+        w = (w << 8) | p[i];
+    return w;
+}
+
+/////////////////////////////// siphash24 //////////////////////////////
+
+ULONGLONG siphash24(const void* data, size_t len, ULONGLONG k0, ULONGLONG k1)
+{
+    ULONGLONG v0 = 0x736f6d6570736575ULL ^ k0;
+    ULONGLONG v1 = 0x646f72616e646f6dULL ^ k1;
+    ULONGLONG v2 = 0x6c7967656e657261ULL ^ k0;
+    ULONGLONG v3 = 0x7465646279746573ULL ^ k1;
+
+    const BYTE* in = (const BYTE*)data;
+    const BYTE* end = in + (len & ~(size_t)7);
+
+    for (; in != end; in += 8) {
+        ULONGLONG m = read_le64(in);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    // Final block carries the remaining bytes and the length
+    ULONGLONG b = ((ULONGLONG)len) << 56;
+    switch (len & 7) {
+        case 7: b |= ((ULONGLONG)in[6]) << 48;
+        case 6: b |= ((ULONGLONG)in[5]) << 40;
+        case 5: b |= ((ULONGLONG)in[4]) << 32;
+        case 4: b |= ((ULONGLONG)in[3]) << 24;
+        case 3: b |= ((ULONGLONG)in[2]) << 16;
+        case 2: b |= ((ULONGLONG)in[1]) << 8;
+        case 1: b |= ((ULONGLONG)in[0]);
+        case 0: break;
+    }
+
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
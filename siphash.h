@@ -0,0 +1,17 @@
+/***********************************************************************
+ siphash.h - Declares SipHash-2-4, the keyed hash used to authenticate
+    stateless probe payloads so forged or foreign replies are rejected.
+***********************************************************************/
+
+#ifndef _SIPHASH_H_
+#define _SIPHASH_H_
+
+#include <rawping.h>
+
+/** Computes SipHash-2-4 of len bytes at data under the 128 bit key
+ *  (k0, k1) and returns the 64 bit tag.
+ */
+extern ULONGLONG siphash24(const void* data, size_t len,
+                           ULONGLONG k0, ULONGLONG k1);
+
+#endif /* _SIPHASH_H_ */
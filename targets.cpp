@@ -0,0 +1,375 @@
+/***********************************************************************
+ targets.cpp - Expands target specifications lazily and produces the
+    addresses in a pseudo-random order with constant memory, using the
+    cyclic group of integers modulo a prime as the permutation.
+***********************************************************************/
+
+#include <targets.h>
+#include <algorithm>
+
+#define MAX_TARGET_SPEC     256
+
+//////////////////////////////// mulmod ////////////////////////////////
+// Returns (a * b) % m.  The prime used by the generator can be just
+// above 2^32, in which case the product no longer fits in 64 bits, so
+// fall back to a shift-and-add multiply for those.
+
+static ULONGLONG mulmod(ULONGLONG a, ULONGLONG b, ULONGLONG m)
+{
+    if (m <= 0xffffffffULL)
+        return (a * b) % m;
+
+    ULONGLONG r = 0;
+    a %= m;
+    while (b) {
+        if (b & 1) {
+            r += a;
+            if (r >= m)
+                r -= m;
+        }
+        a += a;
+        if (a >= m)
+            a -= m;
+        b >>= 1;
+    }
+    return r;
+}
+
+//////////////////////////////// powmod ////////////////////////////////
+// Returns (b ^ e) % m by repeated squaring.
+
+static ULONGLONG powmod(ULONGLONG b, ULONGLONG e, ULONGLONG m)
+{
+    ULONGLONG r = 1 % m;
+    b %= m;
+    while (e) {
+        if (e & 1)
+            r = mulmod(r, b, m);
+        b = mulmod(b, b, m);
+        e >>= 1;
+    }
+    return r;
+}
+
+/////////////////////////////// is_prime ///////////////////////////////
+// Deterministic Miller-Rabin.  The bases below are sufficient for any
+// n < 3.4e14, well beyond the 2^32 + 1 addresses we can be asked for.
+
+static bool is_prime(ULONGLONG n)
+{
+    static const ULONGLONG bases[] = { 2, 3, 5, 7, 11, 13, 17 };
+    const int nbases = sizeof(bases) / sizeof(bases[0]);
+
+    if (n < 2)
+        return false;
+    for (int i = 0; i < nbases; ++i) {
+        if (n == bases[i])
+            return true;
+        if (n % bases[i] == 0)
+            return false;
+    }
+
+    ULONGLONG d = n - 1;
+    int s = 0;
+    while ((d & 1) == 0) {
+        d >>= 1;
+        ++s;
+    }
+
+    for (int i = 0; i < nbases; ++i) {
+        ULONGLONG x = powmod(bases[i], d, n);
+        if (x == 1 || x == n - 1)
+            continue;
+
+        bool composite = true;
+        for (int r = 1; r < s && composite; ++r) {
+            x = mulmod(x, x, n);
+            if (x == n - 1)
+                composite = false;
+        }
+        if (composite)
+            return false;
+    }
+    return true;
+}
+
+////////////////////////////// next_random /////////////////////////////
+// xorshift32, only used to pick the generator and starting point.
+
+static ULONG next_random(ULONG& state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+////////////////////////////// parse_ipv4 //////////////////////////////
+// Parses a dotted quad at s into ip (host byte order).  On success end
+// points just past the last digit consumed.  inet_addr() can't tell
+// 255.255.255.255 apart from a failure, so this is done by hand.
+
+static bool parse_ipv4(const char* s, ULONG& ip, const char*& end)
+{
+    ip = 0;
+    for (int part = 0; part < 4; ++part) {
+        if (part && *s++ != '.')
+            return false;
+        if (*s < '0' || *s > '9')
+            return false;
+
+        ULONG octet = 0;
+        int digits = 0;
+        while (*s >= '0' && *s <= '9' && digits < 3) {
+            octet = octet * 10 + (*s++ - '0');
+            ++digits;
+        }
+        if (octet > 255 || (*s >= '0' && *s <= '9'))
+            return false;
+
+        ip = (ip << 8) | octet;
+    }
+    end = s;
+    return true;
+}
+
+///////////////////////////// merge_ranges /////////////////////////////
+// Sorts ranges and folds together any that overlap or touch.
+
+static bool range_less(const iprange& a, const iprange& b)
+{
+    return a.first < b.first;
+}
+
+static void merge_ranges(std::vector<iprange>& ranges)
+{
+    if (ranges.empty())
+        return;
+
+    std::sort(ranges.begin(), ranges.end(), range_less);
+
+    size_t out = 0;
+    for (size_t i = 1; i < ranges.size(); ++i) {
+        if ((ULONGLONG)ranges[i].first <= (ULONGLONG)ranges[out].last + 1) {
+            if (ranges[i].last > ranges[out].last)
+                ranges[out].last = ranges[i].last;
+        }
+        else
+            ranges[++out] = ranges[i];
+    }
+    ranges.resize(out + 1);
+}
+
+//////////////////////////// subtract_ranges ///////////////////////////
+// Removes every address in exclude from include.  Both must already be
+// merged; the result stays sorted and merged.
+
+static void subtract_ranges(std::vector<iprange>& include,
+                            const std::vector<iprange>& exclude)
+{
+    std::vector<iprange> result;
+    size_t e = 0;
+
+    for (size_t i = 0; i < include.size(); ++i) {
+        ULONGLONG first = include[i].first;
+        ULONGLONG last  = include[i].last;
+
+        // Exclusions ending before this range can't affect later ones
+        while (e < exclude.size() && exclude[e].last < first)
+            ++e;
+
+        for (size_t j = e; j < exclude.size() && exclude[j].first <= last; ++j) {
+            if (exclude[j].first > first) {
+                iprange r = { (ULONG)first, exclude[j].first - 1 };
+                result.push_back(r);
+            }
+            first = (ULONGLONG)exclude[j].last + 1;
+            if (first > last)
+                break;
+        }
+
+        if (first <= last) {
+            iprange r = { (ULONG)first, (ULONG)last };
+            result.push_back(r);
+        }
+    }
+
+    include.swap(result);
+}
+
+////////////////////////////// add_targets /////////////////////////////
+// Parses one target spec into an include or exclude range.
+
+int add_targets(targetgen& tg, const char* spec)
+{
+    if (!spec)
+        return ETARGET_SPEC_INVALID;
+
+    while (*spec == ' ' || *spec == '\t')
+        ++spec;
+
+    std::vector<iprange>* list = &tg.include;
+    if (*spec == '!') {
+        list = &tg.exclude;
+        ++spec;
+    }
+
+    // Trim trailing whitespace into a bounded local copy
+    char buf[MAX_TARGET_SPEC];
+    size_t len = strlen(spec);
+    while (len && (spec[len-1] == ' ' || spec[len-1] == '\t' ||
+                   spec[len-1] == '\r' || spec[len-1] == '\n'))
+        --len;
+    if (!len || len >= MAX_TARGET_SPEC)
+        return ETARGET_SPEC_INVALID;
+    memcpy(buf, spec, len);
+    buf[len] = '\0';
+
+    iprange r;
+    const char* end;
+    if (parse_ipv4(buf, r.first, end)) {
+        if (*end == '\0') {
+            r.last = r.first;
+        }
+        else if (*end == '/') {
+            char* tail;
+            long bits = strtol(end + 1, &tail, 10);
+            if (tail == end + 1 || *tail != '\0' || bits < 0 || bits > 32)
+                return ETARGET_SPEC_INVALID;
+
+            ULONG mask = bits ? (0xffffffffUL << (32 - bits)) : 0;
+            r.first &= mask;
+            r.last = r.first | ~mask;
+        }
+        else if (*end == '-') {
+            const char* tail;
+            if (!parse_ipv4(end + 1, r.last, tail) || *tail != '\0' ||
+                    r.last < r.first)
+                return ETARGET_SPEC_INVALID;
+        }
+        else
+            return ETARGET_SPEC_INVALID;
+    }
+    else {
+        // Not numeric, so try and look it up
+        hostent* hp = gethostbyname(buf);
+        if (hp == 0 || hp->h_addrtype != AF_INET)
+            return ETARGET_SPEC_INVALID;
+
+        ULONG addr;
+        memcpy(&addr, hp->h_addr, sizeof(addr));
+        r.first = r.last = ntohl(addr);
+    }
+
+    list->push_back(r);
+    return WSASUCCESS;
+}
+
+//////////////////////////// prepare_targets ///////////////////////////
+// Merges the ranges, removes exclusions and picks the prime, primitive
+// root and starting element that define this sweep's permutation.
+
+int prepare_targets(targetgen& tg, ULONG seed)
+{
+    merge_ranges(tg.include);
+    merge_ranges(tg.exclude);
+    subtract_ranges(tg.include, tg.exclude);
+
+    tg.offsets.resize(tg.include.size());
+    tg.total = 0;
+    for (size_t i = 0; i < tg.include.size(); ++i) {
+        tg.offsets[i] = tg.total;
+        tg.total += (ULONGLONG)tg.include[i].last - tg.include[i].first + 1;
+    }
+
+    tg.started = false;
+    tg.done = true;
+    if (tg.total == 0)
+        return ETARGET_SPACE_EMPTY;
+
+    // Group elements are 1..prime-1, each maps to target index element-1
+    tg.prime = tg.total + 1;
+    while (!is_prime(tg.prime))
+        ++tg.prime;
+
+    // Distinct prime factors of the group order, for the root test
+    std::vector<ULONGLONG> factors;
+    ULONGLONG order = tg.prime - 1;
+    for (ULONGLONG f = 2; f * f <= order; ++f) {
+        if (order % f == 0) {
+            factors.push_back(f);
+            while (order % f == 0)
+                order /= f;
+        }
+    }
+    if (order > 1)
+        factors.push_back(order);
+
+    ULONG state = seed ? seed : GetTickCount();
+    if (!state)
+        state = 0x9e3779b9;
+
+    tg.gen = 1;
+    if (tg.prime > 2) {
+        for (;;) {
+            ULONGLONG g = 2 + next_random(state) % (tg.prime - 2);
+            bool root = true;
+            for (size_t i = 0; i < factors.size() && root; ++i)
+                root = powmod(g, (tg.prime - 1) / factors[i], tg.prime) != 1;
+            if (root) {
+                tg.gen = g;
+                break;
+            }
+        }
+    }
+
+    tg.start = 1 + next_random(state) % (tg.prime - 1);
+    tg.current = tg.start;
+    tg.done = false;
+
+    return WSASUCCESS;
+}
+
+////////////////////////////// next_target /////////////////////////////
+// Steps the permutation until it lands on a valid target index, then
+// maps that index back onto its include range.
+
+bool next_target(targetgen& tg, sockaddr_in& dest)
+{
+    while (!tg.done) {
+        if (!tg.started) {
+            tg.started = true;
+            tg.current = tg.start;
+        }
+        else {
+            tg.current = mulmod(tg.current, tg.gen, tg.prime);
+            if (tg.current == tg.start) {
+                tg.done = true;
+                break;
+            }
+        }
+
+        // The prime is a little above total, so a few elements are spare
+        if (tg.current > tg.total)
+            continue;
+
+        ULONGLONG index = tg.current - 1;
+        size_t r = std::upper_bound(tg.offsets.begin(), tg.offsets.end(), index)
+                        - tg.offsets.begin() - 1;
+
+        memset(&dest, 0, sizeof(dest));
+        dest.sin_family = AF_INET;
+        dest.sin_addr.s_addr = htonl((ULONG)(tg.include[r].first +
+                                             (index - tg.offsets[r])));
+        return true;
+    }
+
+    return false;
+}
+
+////////////////////////////// target_count ////////////////////////////
+
+ULONGLONG target_count(const targetgen& tg)
+{
+    return tg.total;
+}
@@ -0,0 +1,68 @@
+/***********************************************************************
+ targets.h - Declares the target generator used to sweep CIDR blocks,
+    address ranges and exclusion lists without expanding them into
+    host strings first.
+***********************************************************************/
+
+#ifndef _TARGETS_H_
+#define _TARGETS_H_
+
+#include <rawping.h>
+#include <vector>
+
+// An inclusive range of IPv4 addresses in host byte order
+typedef struct _ip_range_ {
+    ULONG   first;
+    ULONG   last;
+} iprange;
+
+typedef struct _target_gen_ {
+    std::vector<iprange>    include;    // Ranges to probe
+    std::vector<iprange>    exclude;    // Ranges never to probe
+    std::vector<ULONGLONG>  offsets;    // Index of the first address of each include range
+    ULONGLONG   total;                  // Addresses covered by include
+    ULONGLONG   prime;                  // Smallest prime greater than total
+    ULONGLONG   gen;                    // Primitive root modulo prime
+    ULONGLONG   start;                  // First group element visited
+    ULONGLONG   current;                // Last group element visited
+    bool        started;
+    bool        done;
+
+    _target_gen_() : total(0), prime(0), gen(0), start(0),
+                     current(0), started(false), done(true) {}
+} targetgen;
+
+/** Adds a target specification to the generator. A spec can be a
+ *  dotted quad ("10.0.0.1"), a CIDR block ("10.0.0.0/16"), an
+ *  inclusive range ("10.0.0.1-10.0.3.254") or a hostname. Prefixing
+ *  the spec with '!' adds it to the exclusion list instead.
+ *  NB: Hostnames are resolved with gethostbyname(), so Winsock must
+ *      already be initialised when they are used.
+ *
+ *  Returns : WSASUCCESS, or ETARGET_SPEC_INVALID if the spec can't be parsed.
+ */
+extern int  add_targets(targetgen& tg, const char* spec);
+
+/** Merges the ranges added so far and picks a fresh permutation of
+ *  the address space. Must be called after the last add_targets() and
+ *  before the first next_target(). A seed of 0 uses GetTickCount().
+ *  Only the merged ranges are kept, so memory depends on the number
+ *  of specs rather than the addresses they cover. The order comes
+ *  from walking the multiplicative group of a prime just above the
+ *  target count, so consecutive probes land in different subnets.
+ *
+ *  Returns : WSASUCCESS, or ETARGET_SPACE_EMPTY if nothing is left to probe.
+ */
+extern int  prepare_targets(targetgen& tg, ULONG seed = 0);
+
+/** Fills dest with the next address to probe, skipping exclusions.
+ *  Returns false once every address has been produced.
+ */
+extern bool next_target(targetgen& tg, sockaddr_in& dest);
+
+/** Number of addresses left to probe once prepare_targets() has
+ *  removed the exclusions from the include ranges.
+ */
+extern ULONGLONG target_count(const targetgen& tg);
+
+#endif /* _TARGETS_H_ */
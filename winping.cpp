@@ -1,4 +1,5 @@
 #include <winping.h>
+#include <ctime>
 
 #define ERROR_BUFFER_SIZE   1000
 
@@ -23,7 +24,8 @@ void prcpy(pingreq * dest, pingreq * src)
 }
 
 
-winping::winping(bool verbose) : verbose_logging(verbose) { err = WSASUCCESS; }
+winping::winping(bool verbose) : verbose_logging(verbose), rtt(NULL), capture(NULL), history(NULL),
+                                     large_payload(false), dont_fragment(false) { err = WSASUCCESS; }
 winping::~winping(void) {}
 
 int winping::tracert(TSTR host,
@@ -44,13 +46,9 @@ int winping::ping(TSTR host,
     if(host.empty())
         return returnc(EINVALID_HOSTNAME);
 
-    // Checks for valid packet size
-    if(!packet_size || packet_size > MAX_PING_DATA_SIZE)
-        return returnc(EPACKET_SIZE_OUT_OF_BOUNDS ^ (packet_size & 0xffff));
-
-    // Checks for valid ttl
-    if(!ttl || ttl > MAX_TTL)
-        return returnc(ETTL_SIZE_OUT_OF_BOUNDS ^ (ttl & 0xffff));
+    int rc = check_params(packet_size, ttl);
+    if(rc != WSASUCCESS)
+        return returnc(rc);
 
     // Checks that winsock is minimum 2.1 compliant
     WSAData wsaData;
@@ -59,27 +57,145 @@ int winping::ping(TSTR host,
 
     // Determines packet size
     packet_size = max(sizeof(ICMPHeader),
-                      min(MAX_PING_DATA_SIZE, (unsigned int)packet_size));
+                      min((unsigned int)max_data_size(), (unsigned int)packet_size));
 
     SOCKET sd;
-    sockaddr_in dest, source;
+    sockaddr_in dest;
     pingreq pr;
 
-    int rc = setup_for_ping(strconv<std::string,TSTR>(host).c_str(),
-                            ttl,
-                            sd,
-                            dest,
-                            timeout,
-                            &pr);
+    rc = setup_for_ping(strconv<std::string,TSTR>(host).c_str(),
+                        ttl,
+                        sd,
+                        dest,
+                        timeout,
+                        &pr);
+
+    if(rc == WSASUCCESS && dont_fragment)
+        rc = ::set_dont_fragment(sd, true);
+
+    if(rc != WSASUCCESS)
+    {
+        // Cleanup
+        WSACleanup();
+        return returnc(rc);
+    }
+
+    ICMPHeader* send_buf = NULL;
+    IPHeader* recv_buf = NULL;
+
+    rc = allocate_buffers(send_buf,
+                          recv_buf,
+                          packet_size);
+
+    if(rc == WSASUCCESS)
+    {
+        if(verbose_logging)
+            _tprintf(_T("Pinging %s with %d bytes of data:\n\n"),
+                     TSTR((!pr.hostname ? pr.addr : pr.hostname)).c_str(),
+                     packet_size);
+
+        USHORT seq_no = 0;
+        rc = ping_attempts(sd, dest, send_buf, recv_buf, packet_size,
+                           attempts, seq_no, pr, ps);
+    }
+
+    // Cleanup
+    closesocket(sd);
+    delete[]send_buf;
+    delete[]recv_buf;
+    WSACleanup();
+
+    return returnc(rc);
+}
+
+int winping::ping(const sockaddr_in& dest,
+                  pingstat * ps,
+                  int packet_size,
+                  int ttl,
+                  int attempts,
+                  int timeout)
+{
+    if(dest.sin_family != AF_INET)
+        return returnc(EINVALID_HOSTNAME);
+
+    int rc = check_params(packet_size, ttl);
+    if(rc != WSASUCCESS)
+        return returnc(rc);
+
+    // Checks that winsock is minimum 2.1 compliant
+    WSAData wsaData;
+    if (WSAStartup(MAKEWORD(WINSOCK_VER_REQ_HIGH, WINSOCK_VER_REQ_LOW), &wsaData) != 0)
+        return returnc(EWINSOCK_VERSION ^ wsaData.wVersion);
+
+    // Determines packet size
+    packet_size = max(sizeof(ICMPHeader),
+                      min((unsigned int)max_data_size(), (unsigned int)packet_size));
+
+    SOCKET sd;
+    if((rc = setup_socket(ttl, sd, timeout)) != WSASUCCESS ||
+       (dont_fragment && (rc = ::set_dont_fragment(sd, true)) != WSASUCCESS))
+    {
+        // Cleanup
+        WSACleanup();
+        return returnc(rc);
+    }
+
+    ICMPHeader* send_buf = NULL;
+    IPHeader* recv_buf = NULL;
+
+    rc = allocate_buffers(send_buf,
+                          recv_buf,
+                          packet_size);
+
+    if(rc == WSASUCCESS)
+    {
+        pingreq pr;
+        pr.dest_ip = dest.sin_addr.s_addr;
+
+        USHORT seq_no = 0;
+        rc = ping_attempts(sd, dest, send_buf, recv_buf, packet_size,
+                           attempts, seq_no, pr, ps);
+    }
+
+    // Cleanup
+    closesocket(sd);
+    delete[]send_buf;
+    delete[]recv_buf;
+    WSACleanup();
+
+    return returnc(rc);
+}
 
+int winping::sweep(targetgen& targets,
+                   pingstat * ps,
+                   int packet_size,
+                   int ttl,
+                   int attempts,
+                   int timeout)
+{
+    int rc = check_params(packet_size, ttl);
     if(rc != WSASUCCESS)
+        return returnc(rc);
+
+    // Checks that winsock is minimum 2.1 compliant
+    WSAData wsaData;
+    if (WSAStartup(MAKEWORD(WINSOCK_VER_REQ_HIGH, WINSOCK_VER_REQ_LOW), &wsaData) != 0)
+        return returnc(EWINSOCK_VERSION ^ wsaData.wVersion);
+
+    // Determines packet size
+    packet_size = max(sizeof(ICMPHeader),
+                      min((unsigned int)max_data_size(), (unsigned int)packet_size));
+
+    // One socket and one set of buffers serve the whole sweep
+    SOCKET sd;
+    if((rc = setup_socket(ttl, sd, timeout)) != WSASUCCESS ||
+       (dont_fragment && (rc = ::set_dont_fragment(sd, true)) != WSASUCCESS))
     {
         // Cleanup
         WSACleanup();
         return returnc(rc);
     }
 
-    int seq_no = 0;
     ICMPHeader* send_buf = NULL;
     IPHeader* recv_buf = NULL;
 
@@ -87,68 +203,366 @@ int winping::ping(TSTR host,
                           recv_buf,
                           packet_size);
 
+    // Sequence numbers keep counting across targets so a late reply
+    // from the previous host is never taken for the current one
+    USHORT seq_no = 0;
+    sockaddr_in dest;
+
+    while(rc == WSASUCCESS && next_target(targets, dest))
+    {
+        pingreq pr;
+        pr.dest_ip = dest.sin_addr.s_addr;
+
+        // An unreachable or expired target is a result, not a reason
+        // to abandon the rest of the sweep
+        ping_attempts(sd, dest, send_buf, recv_buf, packet_size,
+                      attempts, seq_no, pr, ps);
+    }
+
+    // Cleanup
+    closesocket(sd);
+    delete[]send_buf;
+    delete[]recv_buf;
+    WSACleanup();
+
+    return returnc(rc);
+}
+
+int winping::sweep_stateless(targetgen& targets,
+                             pingstat * ps,
+                             int packet_size,
+                             int ttl,
+                             int timeout)
+{
+    int rc = check_params(packet_size, ttl);
     if(rc != WSASUCCESS)
+        return returnc(rc);
+
+    // The stamp has to fit in the payload area
+    if(packet_size < (int)MIN_STATELESS_PACKET_SIZE)
+        return returnc(EPACKET_SIZE_OUT_OF_BOUNDS ^ (packet_size & 0xffff));
+
+    // Checks that winsock is minimum 2.1 compliant
+    WSAData wsaData;
+    if (WSAStartup(MAKEWORD(WINSOCK_VER_REQ_HIGH, WINSOCK_VER_REQ_LOW), &wsaData) != 0)
+        return returnc(EWINSOCK_VERSION ^ wsaData.wVersion);
+
+    probekey key;
+    SOCKET sd;
+    if((rc = init_probe_key(key)) != WSASUCCESS ||
+       (rc = setup_socket(ttl, sd, timeout)) != WSASUCCESS ||
+       (dont_fragment && (rc = ::set_dont_fragment(sd, true)) != WSASUCCESS))
     {
         // Cleanup
-        delete[]send_buf;
-        delete[]recv_buf;
         WSACleanup();
         return returnc(rc);
     }
 
-    if(verbose_logging)
-        _tprintf(_T("Pinging %s with %d bytes of data:\n\n"),
-                 TSTR((!pr.hostname ? pr.addr : pr.hostname)).c_str(),
-                 packet_size);
+    ICMPHeader* send_buf = NULL;
+    IPHeader* recv_buf = NULL;
+
+    // Nothing waits on a single reply, so the socket never blocks
+    u_long nonblocking = 1;
+    if(ioctlsocket(sd, FIONBIO, &nonblocking) == SOCKET_ERROR)
+        rc = WSAGetLastError();
+    else
+        rc = allocate_buffers(send_buf, recv_buf, packet_size);
+
+    ULONGLONG max_age_us = ULONGLONG(timeout) * 1000;
+    USHORT seq_no = 0;
+    sockaddr_in dest;
 
+    while(rc == WSASUCCESS && next_target(targets, dest))
+    {
+        USHORT seq = seq_no++;
+
+        // Wait for room in the send buffer rather than drop the probe.
+        // The stamp is rebuilt for every try so the wait doesn't count
+        // towards the round trip, or age the reply into EPROBE_STALE.
+        for(;;)
+        {
+            init_stateless_packet(send_buf, packet_size, seq, dest, key);
+            if((rc = send_ping(sd, dest, send_buf, packet_size, NULL)) != WSAEWOULDBLOCK)
+                break;
+
+            drain_stateless(sd, send_buf, recv_buf, packet_size, key, max_age_us, ps);
+
+            fd_set wfds;
+            FD_ZERO(&wfds);
+            FD_SET(sd, &wfds);
+            timeval tv = { 0, 1000 };
+            select(0, NULL, &wfds, NULL, &tv);
+        }
+
+        if(rc == WSASUCCESS && capture)
+            pcap_sent(*capture, dest, send_buf, packet_size, ttl);
+
+        // Only unreachable targets fail here, the sweep carries on
+        if(rc != WSAENETDOWN && rc != WSAENOBUFS)
+            rc = WSASUCCESS;
+
+        drain_stateless(sd, send_buf, recv_buf, packet_size, key, max_age_us, ps);
+    }
+
+    // Give the last probes their full timeout to answer
+    ULONGLONG deadline = timestamp_us() + max_age_us;
+    ULONGLONG now;
+    while(rc == WSASUCCESS && (now = timestamp_us()) < deadline)
+    {
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        FD_SET(sd, &rfds);
+        timeval tv;
+        tv.tv_sec = long((deadline - now) / 1000000);
+        tv.tv_usec = long((deadline - now) % 1000000);
+
+        if(select(0, &rfds, NULL, NULL, &tv) > 0)
+            drain_stateless(sd, send_buf, recv_buf, packet_size, key, max_age_us, ps);
+    }
+
+    // Cleanup
+    closesocket(sd);
+    delete[]send_buf;
+    delete[]recv_buf;
+    WSACleanup();
+
+    return returnc(rc);
+}
+
+int winping::path_mtu(const sockaddr_in& dest,
+                      pmtucache& cache,
+                      int& mtu,
+                      int lo,
+                      int hi,
+                      int timeout)
+{
+    if(dest.sin_family != AF_INET)
+        return returnc(EINVALID_HOSTNAME);
+
+    // Checks the bounds describe valid IP datagram sizes
+    if(lo < MIN_PMTU || lo > hi)
+        return returnc(EPACKET_SIZE_OUT_OF_BOUNDS ^ (lo & 0xffff));
+    if(hi > MAX_IP_PACKET_SIZE)
+        return returnc(EPACKET_SIZE_OUT_OF_BOUNDS ^ (hi & 0xffff));
+
+    if(pmtu_lookup(cache, dest.sin_addr.s_addr, mtu))
+        return returnc(WSASUCCESS);
+
+    // Checks that winsock is minimum 2.1 compliant
+    WSAData wsaData;
+    if (WSAStartup(MAKEWORD(WINSOCK_VER_REQ_HIGH, WINSOCK_VER_REQ_LOW), &wsaData) != 0)
+        return returnc(EWINSOCK_VERSION ^ wsaData.wVersion);
+
+    // DF is the whole point here, whatever set_dont_fragment() says
+    SOCKET sd;
+    int rc;
+    if((rc = setup_socket(DEFAULT_TTL, sd, timeout)) == WSASUCCESS &&
+       (rc = ::set_dont_fragment(sd, true)) == WSASUCCESS)
+        rc = pmtu_discover(sd, dest, cache, mtu, lo, hi, timeout);
+
+    // Cleanup
+    if(sd != INVALID_SOCKET)
+        closesocket(sd);
+    WSACleanup();
+
+    return returnc(rc);
+}
+
+int winping::train(const sockaddr_in& dest,
+                   const int * sizes,
+                   int count,
+                   trainresult& result,
+                   int ttl,
+                   int timeout)
+{
+    if(dest.sin_family != AF_INET)
+        return returnc(EINVALID_HOSTNAME);
+
+    if(count < 1 || count > MAX_TRAIN_LENGTH)
+        return returnc(EPACKET_SIZE_OUT_OF_BOUNDS ^ (count & 0xffff));
+
+    // Every probe has to pass the same checks as a single ping
+    int rc;
+    for(int i = 0; i < count; ++i)
+    {
+        if((rc = check_params(sizes[i], ttl)) != WSASUCCESS)
+            return returnc(rc);
+        if(sizes[i] < (int)sizeof(ICMPHeader))
+            return returnc(EPACKET_SIZE_OUT_OF_BOUNDS ^ (sizes[i] & 0xffff));
+    }
+
+    // Checks that winsock is minimum 2.1 compliant
+    WSAData wsaData;
+    if (WSAStartup(MAKEWORD(WINSOCK_VER_REQ_HIGH, WINSOCK_VER_REQ_LOW), &wsaData) != 0)
+        return returnc(EWINSOCK_VERSION ^ wsaData.wVersion);
+
+    // The whole burst can be in the socket at once, and every reply
+    // must fit while we are still sending
+    int sockbuf = 0;
+    for(int i = 0; i < count; ++i)
+        sockbuf += sizes[i] + MAX_IP_HEADER_SIZE;
+
+    SOCKET sd;
+    if((rc = setup_socket(ttl, sd, timeout)) == WSASUCCESS &&
+       (!dont_fragment || (rc = ::set_dont_fragment(sd, true)) == WSASUCCESS))
+    {
+        setsockopt(sd, SOL_SOCKET, SO_SNDBUF, (const char*)&sockbuf, sizeof(sockbuf));
+        setsockopt(sd, SOL_SOCKET, SO_RCVBUF, (const char*)&sockbuf, sizeof(sockbuf));
+
+        rc = packet_train(sd, dest, sizes, count, timeout, result);
+    }
+
+    // Cleanup
+    if(sd != INVALID_SOCKET)
+        closesocket(sd);
+    WSACleanup();
+
+    return returnc(rc);
+}
+
+int winping::max_data_size(void)
+{
+    return large_payload ? MAX_LARGE_PING_DATA_SIZE : MAX_PING_DATA_SIZE;
+}
+
+int winping::check_params(int packet_size, int ttl)
+{
+    // Checks for valid packet size
+    if(!packet_size || packet_size > max_data_size())
+        return EPACKET_SIZE_OUT_OF_BOUNDS ^ (packet_size & 0xffff);
+
+    // Checks for valid ttl
+    if(!ttl || ttl > MAX_TTL)
+        return ETTL_SIZE_OUT_OF_BOUNDS ^ (ttl & 0xffff);
+
+    return WSASUCCESS;
+}
+
+int winping::ping_attempts(SOCKET sd,
+                           const sockaddr_in& dest,
+                           ICMPHeader * send_buf,
+                           IPHeader * recv_buf,
+                           int packet_size,
+                           int attempts,
+                           USHORT& seq_no,
+                           pingreq& pr,
+                           pingstat * ps)
+{
+    sockaddr_in source;
+    int rc = WSASUCCESS;
     int attempt=0;
 
+    // Only needed to fill in the synthesized header of sent packets
+    int ttl=0;
+    int optlen=sizeof(ttl);
+    if(capture)
+        getsockopt(sd, IPPROTO_IP, IP_TTL, (char*)&ttl, &optlen);
+
     // Loops for specified number of attempts
     while((rc == WSASUCCESS || rc == WSAETIMEDOUT) &&
-          attempts == PING_INFINITE ? PING_INFINITE : attempt++ < attempts)
+          (attempts == PING_INFINITE || attempt++ < attempts))
     {
+        // A damaged reply to an earlier attempt must not be copied
+        // into this one's record if it goes unanswered
+        pr.bad_checksum = 0;
+        pr.bytes_mismatched = 0;
+        pr.bytes_truncated = 0;
+
         // Re-initializes ping packet for next ping
         init_ping_packet(send_buf,
              packet_size,
              seq_no,
              &pr);
 
+        // With an estimator attached each probe gets its own deadline,
+        // backed off for every unanswered probe to this host in a row
+        DWORD deadline_ms = rtt ? rtt_deadline_ms(*rtt, dest.sin_addr.s_addr) : 0;
+        ULONGLONG sent_us = timestamp_us();
+
         // Send the ping and receive the reply
         if((rc = send_ping(sd, dest, send_buf, packet_size, &pr)) == WSASUCCESS)
         {
+            if(capture)
+                pcap_sent(*capture, dest, send_buf, packet_size, ttl);
+
             // Keeps re-trying until the host can be reach or until
             // the timeout specification is met
             while(true)
             {
-                // Receive replies until we either get a successful read,
-                // or a fatal error occurs.
-                if((rc = recv_ping(sd, source, recv_buf, MAX_PING_PACKET_SIZE, &pr)) != WSASUCCESS)
+                if(rtt)
                 {
-                    // Pull the sequence number out of the ICMP header.  If
-                    // it's bad, we just complain, but otherwise we take
-                    // off, because the read failed for some reason.
-                    unsigned short header_len = recv_buf->h_len * 4;
-                    ICMPHeader* icmphdr = (ICMPHeader*)((char*)recv_buf + header_len);
-                    if (icmphdr->seq != seq_no)
-                        continue;
-                    else
+                    // Only what is left of the deadline, foreign replies
+                    // must not extend it
+                    ULONGLONG waited_ms = (timestamp_us() - sent_us) / 1000;
+                    if(waited_ms >= deadline_ms)
+                    {
+                        rc = WSAETIMEDOUT;
                         break;
+                    }
+
+                    DWORD remaining = DWORD(deadline_ms - waited_ms);
+                    setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO,
+                               (const char *)&remaining, sizeof(remaining));
                 }
-                // Success or fatal error (as opposed to a minor error) so finish up
-                if((rc = decode_reply(recv_buf, packet_size, &source, &pr)) != WSATRY_AGAIN)
+
+                // Receive replies until we either get a successful read,
+                // or a fatal error occurs.
+                if((rc = recv_ping(sd, source, recv_buf, RECV_DATA_SIZE(packet_size), &pr)) != WSASUCCESS)
+                    break;
+
+                if(capture)
+                    pcap_received(*capture, recv_buf, pr.bytes_recv);
+
+                // Success or fatal error (as opposed to a minor error) so finish up,
+                // unless the reply, or the probe an ICMP error quotes, belongs
+                // to an earlier sequence number, e.g. the previous target's
+                rc = decode_reply(recv_buf, pr.bytes_recv, &source, &pr);
+                bool has_seq = rc == WSASUCCESS || rc == WSAEHOSTUNREACH ||
+                               (rc & 0xefff0000) == ETTL_EXPIRED;
+                if(rc != WSATRY_AGAIN && (!has_seq || pr.seq == seq_no))
                     break;
             }
 
+            pr.rtt_us = rc == WSASUCCESS ? ULONG(timestamp_us() - sent_us) : 0;
+
+            // A damaged echo still proves the host is up, so it only
+            // gets flagged in the pingreq rather than failing the attempt
+            if(rc == WSASUCCESS)
+                verify_reply(recv_buf, pr.bytes_recv, send_buf, packet_size,
+                             sizeof(ICMPHeader), &pr);
+
+            if(rtt)
+            {
+                if(rc == WSASUCCESS)
+                    rtt_sample(*rtt, dest.sin_addr.s_addr, pr.rtt_us);
+                else if(rc == WSAETIMEDOUT)
+                    rtt_timeout(*rtt, dest.sin_addr.s_addr);
+            }
+
+            // Only targets registered up front are recorded, adding one
+            // here could move the buckets under a concurrent reader
+            size_t hist_index = history ? hist_target(*history, dest.sin_addr.s_addr, false)
+                                        : HIST_NO_TARGET;
+            if(hist_index != HIST_NO_TARGET && (rc == WSASUCCESS || rc == WSAETIMEDOUT))
+                hist_record(*history,
+                            hist_index,
+                            ULONG(time(NULL)),
+                            rc == WSAETIMEDOUT,
+                            pr.rtt_us);
+
             // Determine if request timed out
             rc == WSAETIMEDOUT ? (pr.bytes_recv = REQUEST_TIMEOUT) : 0;
         }
 
+        pr.status = rc;
+        ++seq_no;
+
         if(verbose_logging)
             printpr(pr);
 
         // This is to stop memory allocation errors
         // when the option to ping infinitely has been selected.
-        if(attempts != PING_INFINITE)
+        if(attempts != PING_INFINITE && ps)
         {
             // Makes a copy of the current pingreq to save
             pingreq * tmp = new pingreq;
@@ -162,12 +576,91 @@ int winping::ping(TSTR host,
     if(rc == WSAETIMEDOUT)
         rc = WSASUCCESS;
 
-    // Cleanup
-    delete[]send_buf;
-    delete[]recv_buf;
-    WSACleanup();
+    return rc;
+}
 
-    return returnc(rc);
+
+void winping::drain_stateless(SOCKET sd,
+                              ICMPHeader * send_buf,
+                              IPHeader * recv_buf,
+                              int packet_size,
+                              const probekey& key,
+                              ULONGLONG max_age_us,
+                              pingstat * ps)
+{
+    sockaddr_in source;
+    pingreq pr;
+
+    // Reads until the socket has nothing left queued
+    while(recv_ping(sd, source, recv_buf, RECV_DATA_SIZE(packet_size), &pr) == WSASUCCESS)
+    {
+        if(capture)
+            pcap_received(*capture, recv_buf, pr.bytes_recv);
+
+        // Replies that fail the stamp checks are dropped silently
+        if(decode_stateless_reply(recv_buf, pr.bytes_recv, &source,
+                                  key, max_age_us, &pr) != WSASUCCESS)
+            continue;
+
+        // Every probe shares the padding after the stamp, so the last
+        // one sent serves as the template
+        verify_reply(recv_buf, pr.bytes_recv, send_buf, packet_size,
+                     MIN_STATELESS_PACKET_SIZE, &pr);
+
+        // Silent targets leave no trace here, so only answers are
+        // recorded, and only for targets registered up front
+        size_t hist_index = history ? hist_target(*history, pr.dest_ip, false)
+                                    : HIST_NO_TARGET;
+        if(hist_index != HIST_NO_TARGET)
+            hist_record(*history,
+                        hist_index,
+                        ULONG(time(NULL)),
+                        false,
+                        pr.rtt_us);
+
+        if(verbose_logging)
+            printpr(pr);
+
+        if(ps)
+        {
+            // Makes a copy of the current pingreq to save
+            pingreq * tmp = new pingreq;
+            prcpy(tmp, &pr);
+
+            // Adds the ping request data to the running list
+            ps->pings.push_back(tmp);
+        }
+    }
+}
+
+
+void winping::set_rtt_table(rtttable * table)
+{
+    rtt = table;
+}
+
+
+void winping::set_large_payload(bool large)
+{
+    large_payload = large;
+}
+
+
+void winping::set_dont_fragment(bool df)
+{
+    dont_fragment = df;
+}
+
+
+void winping::set_history(rtthistory * h)
+{
+    history = h;
+}
+
+
+void winping::set_capture(pcapture * pc)
+{
+    capture = pc;
 }
 
 
@@ -197,7 +690,7 @@ void winping::print_error(void)
                            _T("Packet size out of bounds, 0 > %d or %d > %d."),
                            GET_ERR_VALUE(err),
                            GET_ERR_VALUE(err),
-                           MAX_PING_DATA_SIZE);
+                           max_data_size());
                 message = TSTR(buffer);
                 break;
             case ETTL_EXPIRED:
@@ -226,6 +719,38 @@ void winping::print_error(void)
                            GET_ERR_VALUE(err));
                 message = TSTR(buffer);
                 break;
+            case EPROBE_MAC_INVALID:
+                message = _T("Probe reply failed authentication.");
+                break;
+            case EPROBE_STALE:
+                message = _T("Probe reply arrived after its deadline.");
+                break;
+            case EREPLY_CORRUPTED:
+                TSPRINTF_S(buffer,
+                           ERROR_BUFFER_SIZE,
+                           _T("Reply payload corrupted, %d bytes differ."),
+                           GET_ERR_VALUE(err));
+                message = TSTR(buffer);
+                break;
+            case EREPLY_TRUNCATED:
+                TSPRINTF_S(buffer,
+                           ERROR_BUFFER_SIZE,
+                           _T("Reply truncated by %d bytes."),
+                           GET_ERR_VALUE(err));
+                message = TSTR(buffer);
+                break;
+            case ETARGET_SPEC_INVALID:
+                message = _T("Invalid target specification.");
+                break;
+            case ETARGET_SPACE_EMPTY:
+                message = _T("No targets left to probe after exclusions.");
+                break;
+            case EPCAP_OPEN_FAILED:
+                message = _T("Failed to open or write the capture file.");
+                break;
+            case EPCAP_FORMAT:
+                message = _T("Capture file is not a raw IPv4 pcap file.");
+                break;
             case EWINSOCK_VERSION:
                 TSPRINTF_S(buffer,
                            ERROR_BUFFER_SIZE,
@@ -268,19 +793,41 @@ int winping::returnc(int rc)
 
 void printpr(pingreq &r)
 {
-    if(r.bytes_recv != REQUEST_TIMEOUT)
-    {
-        _tprintf(_T("Reply from %hs: bytes=%d time%hs%dms hops=%d TTL=%d\n"),
-                 TSTR(r.addr).c_str(),
-                 r.packet_size,
-                 r.timems == 0 ? _T("=<") : _T("="),
-                 r.timems == 0 ? 1 : r.timems,
-                 r.hops,
-                 r.ttl);
-    }
-    else
+    // Numeric targets carry no address string, so format it here
+    // rather than on the send path
+    in_addr ia;
+    ia.s_addr = r.dest_ip;
+    const char * addr = r.addr ? r.addr : inet_ntoa(ia);
+
+    switch(IS_PING_ERR(r.status) ? r.status & 0xefff0000 : r.status)
     {
-        _tprintf(_T("Request timed out for %hs\n"),
-                 TSTR(r.addr).c_str());
+        case WSASUCCESS:
+            _tprintf(_T("Reply from %hs: bytes=%d time%hs%dms hops=%d TTL=%d%hs\n"),
+                     TSTR(addr).c_str(),
+                     r.packet_size,
+                     r.timems == 0 ? _T("=<") : _T("="),
+                     r.timems == 0 ? 1 : r.timems,
+                     r.hops,
+                     r.ttl,
+                     r.bytes_truncated ? " (truncated)" :
+                     r.bad_checksum || r.bytes_mismatched ? " (corrupted)" : "");
+            break;
+        case WSAETIMEDOUT:
+            _tprintf(_T("Request timed out for %hs\n"),
+                     TSTR(addr).c_str());
+            break;
+        case WSAEHOSTUNREACH:
+            _tprintf(_T("Destination host unreachable for %hs\n"),
+                     TSTR(addr).c_str());
+            break;
+        case ETTL_EXPIRED:
+            _tprintf(_T("TTL expired in transit for %hs\n"),
+                     TSTR(addr).c_str());
+            break;
+        default:
+            _tprintf(_T("Request failed for %hs [0x%.8x]\n"),
+                     TSTR(addr).c_str(),
+                     r.status);
+            break;
     }
 }
@@ -25,6 +25,12 @@
 #if defined(_MSC_VER)
 
 #include <rawping.h>
+#include <targets.h>
+#include <rttest.h>
+#include <pcapture.h>
+#include <pmtu.h>
+#include <rtthist.h>
+#include <pkttrain.h>
 #include <vector>
 
 #ifndef TSTR
@@ -88,6 +94,11 @@ class winping
         bool    verbose_logging;        // For verbose live ping requests instead
                                         // of waiting for ping to finish all attempts
         DWORD   err;                    // Keeps the last error result
+        rtttable * rtt;                 // Per host estimators, NULL for fixed timeouts
+        pcapture * capture;             // Packet capture, NULL when disabled
+        rtthistory * history;           // Per target RTT/loss history, NULL when disabled
+        bool    large_payload;          // Allows packets up to MAX_LARGE_PING_DATA_SIZE
+        bool    dont_fragment;          // Sets DF on every probe
 
     public:
         /* Initialize winping() with verbose logging, default to no logging */
@@ -107,7 +118,8 @@ class winping
          *      @host       : IPv4 address or fully qualified hostname.
          *      @pingstats  : Dynamically allocated pingreq structs with the ping result
          *                      of each ping sequentially. Disabled under PING_INFINITE option.
-         *      @packetsize : (Optional) Packet size to ping not exceeding MAX_PING_PACKET_SIZE.
+         *      @packetsize : (Optional) Packet size to ping not exceeding MAX_PING_DATA_SIZE,
+         *                      or MAX_LARGE_PING_DATA_SIZE with set_large_payload().
          *      @ttl        : (Optional) TTL (Time to Live) value not exceeding MAX_TTL.
          *      @attempts   : (Optional) Number of ping attempts to make total, if
          *                      PING_INFINITE is supplied it will disable memory allocation
@@ -116,6 +128,9 @@ class winping
          *      @timeout    : (Optional) Timeout in milliseconds to wait for host response per ping
          *
          *  Returns : WSASUCCESS on normal operation, otherwise will return an error code.
+         *            Attempts stop at the first error other than a timeout, and
+         *            that error is returned. Each attempt sends the next
+         *            sequence number, starting from 0.
          *            NB: Use print_error() to display the formatted error result and value.
          */
         int     ping(TSTR host,
@@ -125,6 +140,133 @@ class winping
                      int = DEFAULT_ATTEMPTS,
                      int = DEFUALT_TIMEOUT_MS);
 
+        /** Pings a numeric IPv4 address. Behaves like ping() above but
+         *  skips name resolution and never formats the address string,
+         *  so pingreq::addr and pingreq::hostname are left NULL.
+         *      @dest       : Destination with sin_family AF_INET.
+         *      Remaining parameters as per ping() above.
+         */
+        int     ping(const sockaddr_in& dest,
+                     pingstat *,
+                     int = DEFAULT_PACKET_SIZE,
+                     int = DEFAULT_TTL,
+                     int = DEFAULT_ATTEMPTS,
+                     int = DEFUALT_TIMEOUT_MS);
+
+        /** Pings every address produced by a prepared targetgen in its
+         *  randomized order, reusing a single socket and buffer pair.
+         *      @targets    : Generator already passed through prepare_targets().
+         *      @pingstats  : (Optional) Receives one pingreq per attempt per target.
+         *      @attempts   : (Optional) Number of attempts made per target.
+         *      Remaining parameters as per ping() above.
+         *
+         *  Returns : WSASUCCESS once every target has been tried, otherwise
+         *            the setup error. Per target failures are left in @pingstats,
+         *            each pingreq's status saying why it got no reply.
+         */
+        int     sweep(targetgen& targets,
+                      pingstat *,
+                      int = DEFAULT_PACKET_SIZE,
+                      int = DEFAULT_TTL,
+                      int = DEFAULT_ATTEMPTS,
+                      int = DEFUALT_TIMEOUT_MS);
+
+        /** Sweeps a prepared targetgen without waiting on any reply.
+         *  Each probe carries its own target, send time and MAC in the
+         *  payload (see init_stateless_packet), so no per-probe state is
+         *  kept and any number of probes can be in flight at once.
+         *  NB: Only replies are recorded, silent targets leave no entry,
+         *      in @pingstats or in an attached history store, whose
+         *      buckets therefore never show loss for these sweeps.
+         *      @targets    : Generator already passed through prepare_targets().
+         *      @pingstats  : (Optional) Receives one pingreq per valid reply.
+         *      @packetsize : (Optional) At least MIN_STATELESS_PACKET_SIZE.
+         *      @ttl        : (Optional) TTL value not exceeding MAX_TTL.
+         *      @timeout    : (Optional) Milliseconds a reply stays valid, and how
+         *                      long to keep listening after the last send.
+         */
+        int     sweep_stateless(targetgen& targets,
+                                pingstat *,
+                                int = DEFAULT_PACKET_SIZE,
+                                int = DEFAULT_TTL,
+                                int = DEFUALT_TIMEOUT_MS);
+
+        /** Attaches a round trip time table that then sizes the deadline
+         *  of every probe from that host's SRTT/RTTVAR. The @timeout given
+         *  to ping() still bounds socket operations; the table's
+         *  max_rto_ms bounds each deadline. Estimates persist in the table
+         *  across calls, pass NULL to go back to the fixed timeout.
+         *  NB: The table is not owned and must outlive its use here.
+         */
+        void    set_rtt_table(rtttable *);
+
+        /** Lifts the packet size limit from MAX_PING_DATA_SIZE to
+         *  MAX_LARGE_PING_DATA_SIZE, for jumbo frame paths. Receive buffers
+         *  are sized per call from the packet size.
+         */
+        void    set_large_payload(bool);
+
+        /** Sets the Don't Fragment bit on every probe sent from now on, so
+         *  oversized probes fail instead of being fragmented.
+         */
+        void    set_dont_fragment(bool);
+
+        /** Discovers the path MTU towards @dest by sending several DF
+         *  probes per round and narrowing on replies, Fragmentation
+         *  Needed messages and losses (see pmtu_discover).
+         *      @dest       : Destination with sin_family AF_INET.
+         *      @cache      : Results are reused from, and stored into, this cache.
+         *      @mtu        : Receives the largest IP datagram size that got through.
+         *      @lo, @hi    : (Optional) IP datagram size bounds to search.
+         *      @timeout    : (Optional) Milliseconds to wait on each round.
+         *
+         *  Returns : WSASUCCESS, or WSAETIMEDOUT if no probe was ever answered.
+         */
+        int     path_mtu(const sockaddr_in& dest,
+                         pmtucache& cache,
+                         int& mtu,
+                         int = MIN_PMTU,
+                         int = DEFAULT_PMTU_MAX,
+                         int = DEFAULT_PMTU_TIMEOUT_MS);
+
+        /** Sends a packet train of mixed sizes to @dest in one burst and
+         *  estimates bottleneck capacity, dispersion and queueing delay
+         *  from the reply timings (see packet_train).
+         *      @dest       : Destination with sin_family AF_INET.
+         *      @sizes      : Packet size of each probe, each within the
+         *                      current payload limit.
+         *      @count      : Number of probes, not exceeding MAX_TRAIN_LENGTH.
+         *      @result     : Receives per probe timings and the estimates.
+         *      @ttl        : (Optional) TTL value not exceeding MAX_TTL.
+         *      @timeout    : (Optional) Milliseconds to wait for the replies.
+         *
+         *  Returns : WSASUCCESS, or WSAETIMEDOUT if no reply came back.
+         */
+        int     train(const sockaddr_in& dest,
+                      const int * sizes,
+                      int count,
+                      trainresult& result,
+                      int = DEFAULT_TTL,
+                      int = DEFAULT_TRAIN_TIMEOUT);
+
+        /** Attaches a capture opened with pcap_open(). Every request sent
+         *  and reply received by this winping is recorded to it. Pass
+         *  NULL to stop capturing.
+         *  NB: The capture is not owned and must outlive its use here.
+         */
+        void    set_capture(pcapture *);
+
+        /** Attaches a history store that every answered or timed out
+         *  probe is recorded into, by destination address. Pass NULL to
+         *  stop recording.
+         *  NB: sweep_stateless() keeps no record of unanswered probes, so
+         *      it only records replies and never counts a loss.
+         *      Only destinations already added with hist_target() are
+         *      recorded, so readers never see the store grow. The store
+         *      is not owned and must outlive its use here.
+         */
+        void    set_history(rtthistory *);
+
         /** Returns the last error code generated by winping()
          *
          *  NB: See possible error code table above for 99% of return codes
@@ -145,6 +287,34 @@ class winping
     private:
         /** Sets the last return code before returning */
         int     returnc(int);
+
+        /** Packet size limit under the current payload mode */
+        int     max_data_size(void);
+
+        /** Validates packet size and TTL, returns the matching error code */
+        int     check_params(int, int);
+
+        /** Runs the send/receive attempts for one destination on an
+         *  already configured socket, advancing @seq_no per attempt.
+         */
+        int     ping_attempts(SOCKET,
+                              const sockaddr_in&,
+                              ICMPHeader *,
+                              IPHeader *,
+                              int,
+                              int,
+                              USHORT&,
+                              pingreq&,
+                              pingstat *);
+
+        /** Decodes every stateless reply queued on a non-blocking socket */
+        void    drain_stateless(SOCKET,
+                                ICMPHeader *,
+                                IPHeader *,
+                                int,
+                                const probekey&,
+                                ULONGLONG,
+                                pingstat *);
 };
 
 #endif  /* Microsoft Compiler check */